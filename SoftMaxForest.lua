@@ -9,7 +9,7 @@ function SoftMaxForest:__init(inputSize, trees, rootIds, gaterSize, gaterAct, ac
    self.smts = {}
    for i,tree in ipairs(trees) do
       local smt = nn.SoftMaxTree(inputSize, tree, rootIds[i], accUpdate)
-      table.insert(self._smts, smt)
+      table.insert(self.smts, smt)
       self.experts:add(smt)
    end
 
@@ -26,8 +26,8 @@ function SoftMaxForest:__init(inputSize, trees, rootIds, gaterSize, gaterAct, ac
 
    -- mixture
    self.trunk = nn.ConcatTable()
-   self.trunk:add(self._gater)
-   self.trunk:add(self._experts)
+   self.trunk:add(self.gater)
+   self.trunk:add(self.experts)
    self.mixture = nn.MixtureTable()
    self.module = nn.Sequential()
    self.module:add(self.trunk)
@@ -36,8 +36,59 @@ function SoftMaxForest:__init(inputSize, trees, rootIds, gaterSize, gaterAct, ac
    self.modules[1] = self.module
 end
 
+-- At inference (after evaluate()), the experts whose gater weight is
+-- below threshold for a sample are not evaluated for that sample (the
+-- expert of largest weight always is). Their weights are zeroed and the
+-- kept weights of the sample are renormalized to sum to 1, such that 
+-- the output is the mixture of the evaluated experts only.
+function SoftMaxForest:skipThreshold(threshold)
+   self.threshold = threshold
+   return self
+end
+
+-- the experts are evaluated together by a single parallel kernel
+-- (unless one of them needs its own forward)
+function SoftMaxForest:_parallelForward(input)
+   if not input.nn.SoftMaxTree_forestOutput then
+      return false -- e.g. CudaTensor
+   end
+   for i,smt in ipairs(self.smts) do
+      if smt.quantized then
+         return false
+      end
+   end
+   return true
+end
+
 function SoftMaxForest:updateOutput(input)
-   self.output = self.module:updateOutput(input)
+   local inputs, target = input[1], input[2]
+   if not self:_parallelForward(inputs) then
+      self.output = self.module:updateOutput(input)
+      return self.output
+   end
+   local gate = self.gater:updateOutput(input)
+   -- fill in the outputs of the containers, as used by the backward
+   self.experts.output = self.experts.output or {}
+   for i,smt in ipairs(self.smts) do
+      smt:prepareBuffers(inputs, target)
+      self.experts.output[i] = smt.output
+   end
+   self.trunk.output = {gate, self.experts.output}
+
+   local threshold = (not self.train) and self.threshold or nil
+   inputs.nn.SoftMaxTree_forestOutput(self.smts, inputs, target, threshold and gate, threshold or 0)
+   if threshold then
+      -- same rule as the kernel : skip gate < min(threshold, max gate of the row)
+      local bound = gate:max(2):clamp(-math.huge, threshold)
+      self._gate = self._gate or gate.new()
+      local kept = self._gate:resizeAs(gate):copy(gate)
+      kept:maskedFill(gate:lt(bound:expandAs(gate)), 0)
+      kept:cdiv(kept:sum(2):expandAs(kept))
+      self.trunk.output[1] = kept
+   end
+
+   self.output = self.mixture:updateOutput(self.trunk.output)
+   self.module.output = self.output
    return self.output
 end
 
@@ -11,51 +11,8 @@ function SoftMaxTree:__init(inputSize, hierarchy, rootId, accUpdate, static, ver
    self.rootId = rootId or 1
    self.inputSize = inputSize
    self.accUpdate = accUpdate
-   assert(type(hierarchy) == 'table', "Expecting table at arg 2")
-   -- get the total amount of children (non-root nodes)
-   local nChildNode = 0
-   local nParentNode = 0
-   local maxNodeId = -999999999
-   local minNodeId = 999999999
-   local maxParentId = -999999999
-   local maxChildId = -999999999
-   local maxFamily = -999999999
-   local parentIds = {}
-   for parentId, children in pairs(hierarchy) do
-      assert(children:dim() == 1, "Expecting table of 1D tensors at arg 2")
-      nChildNode = nChildNode + children:size(1)
-      nParentNode = nParentNode + 1
-      maxParentId = math.max(parentId, maxParentId)
-      maxFamily = math.max(maxFamily, children:size(1))
-      local maxChildrenId = children:max()
-      maxChildId = math.max(maxChildrenId, maxChildId)
-      maxNodeId = math.max(parentId, maxNodeId, maxChildrenId)
-      minNodeId = math.min(parentId, minNodeId, children:min())
-      table.insert(parentIds, parentId)
-   end
-   if minNodeId < 0 then
-      error("nodeIds must must be positive: "..minNodeId, 2)
-   end
-   if verbose then
-      print("Hierachy has :")
-      print(nParentNode.." parent nodes")
-      print(nChildNode.." child nodes")
-      print((nChildNode - nParentNode).." leaf nodes")
-      print("node index will contain "..maxNodeId.." slots")
-      if maxNodeId ~= (nChildNode + 1) then
-         print("Warning: Hierarchy has more nodes than Ids")
-         print("Consider making your nodeIds a contiguous sequence ")
-         print("in order to waste less memory on indexes.")
-      end
-   end
 
-   self.nChildNode = nChildNode
-   self.nParentNode = nParentNode
-   self.minNodeId = minNodeId
-   self.maxNodeId = maxNodeId
-   self.maxParentId = maxParentId
-   self.maxChildId = maxChildId
-   self.maxFamily = maxFamily
+   self:buildIndex(hierarchy, verbose)
 
    -- initialize weights and biases
    self.weight = torch.Tensor(self.nChildNode, self.inputSize)
@@ -65,83 +22,347 @@ function SoftMaxTree:__init(inputSize, hierarchy, rootId, accUpdate, static, ver
       self.gradBias = torch.Tensor(self.nChildNode)
    end
 
-   -- contains all childIds
-   self.childIds = torch.IntTensor(self.nChildNode)
-   -- contains all parentIds
-   self.parentIds = torch.IntTensor(parentIds)
+   self:initBuffers(static)
 
-   -- index of children by parentId
-   self.parentChildren = torch.IntTensor(self.maxParentId, 2):fill(-1)
-   local start = 1
-   for parentId, children in pairs(hierarchy) do
-      local node = self.parentChildren:select(1, parentId)
-      node[1] = start
-      local nChildren = children:size(1)
-      node[2] = nChildren
-      self.childIds:narrow(1, start, nChildren):copy(children)
-      start = start + nChildren
-   end
+   self:reset()
+end
 
-   -- index of parent by childId
-   self.childParent = torch.IntTensor(self.maxChildId, 2):fill(-1)
-   for parentIdx=1,self.parentIds:size(1) do
-      local parentId = self.parentIds[parentIdx]
-      local node = self.parentChildren:select(1, parentId)
-      local start = node[1]
-      local nChildren = node[2]
-      local children = self.childIds:narrow(1, start, nChildren)
-      for childIdx=1,children:size(1) do
-         local childId = children[childIdx]
-         local child = self.childParent:select(1, childId)
-         child[1] = parentId
-         child[2] = childIdx
+-- Builds the index of the tree from the hierarchy, which is either a 
+-- table of 1D IntTensors of children indexed by parentId, or a 
+-- nEdge x 2 IntTensor of {childId, parentId} (faster for huge trees). 
+-- The index is built in C :
+-- childIds : the children of each parent, in the order of the rows of weight
+-- parentIds : the parents, in order of first appearance
+-- parentChildren : index of {start, nChildren} in childIds by parentId
+-- childParent : index of {parentId, childIdx} by childId
+-- pathTable : the path from each child node up to the root, one row per
+--    step : {parentId, parentIdx, childIdx, nChildren, offset}, where
+--    offset is the number of buffer entries used by the previous steps
+-- childPath : index of {start, nStep} in pathTable by childId
+function SoftMaxTree:buildIndex(hierarchy, verbose)
+   local edges = hierarchy
+   if type(hierarchy) == 'table' then
+      local nEdge = 0
+      for parentId, children in pairs(hierarchy) do
+         assert(children:dim() == 1, "Expecting table of 1D tensors at arg 2")
+         nEdge = nEdge + children:size(1)
       end
+      edges = torch.IntTensor(nEdge, 2)
+      local start = 1
+      for parentId, children in pairs(hierarchy) do
+         local nChildren = children:size(1)
+         local family = edges:narrow(1, start, nChildren)
+         family:select(2,1):copy(children)
+         family:select(2,2):fill(parentId)
+         start = start + nChildren
+      end
+   else
+      assert(torch.type(hierarchy) == 'torch.IntTensor', "Expecting table or IntTensor at arg 2")
    end
+   torch.Tensor().nn.SoftMaxTree_buildIndex(self, edges)
 
-   -- used to allocate buffers
-   -- max nChildren in family path
-   local maxFamilyPath = -999999999
-   -- max number of parents
-   local maxDept = -999999999
-   local treeSizes = {[rootId] = self.parentChildren[rootId][2]}
-   local pathSizes = {[rootId] = 1}
-   local function getSize(nodeId)
-      local treeSize, pathSize = treeSizes[nodeId], pathSizes[nodeId]
-      if not treeSize then
-         local parentId = self.childParent[nodeId][1]
-         local nChildren = self.parentChildren[nodeId][2]
-         treeSize, pathSize = getSize(parentId)
-         treeSize = treeSize + nChildren
-         pathSize = pathSize + 1
-         treeSizes[nodeId] = treeSize
-         pathSizes[nodeId] = pathSize
+   if verbose then
+      print("Hierachy has :")
+      print(self.nParentNode.." parent nodes")
+      print(self.nChildNode.." child nodes")
+      print((self.nChildNode - self.nParentNode).." leaf nodes")
+      print("node index will contain "..self.maxNodeId.." slots")
+      if self.maxNodeId ~= (self.nChildNode + 1) then
+         print("Warning: Hierarchy has more nodes than Ids")
+         print("Consider making your nodeIds a contiguous sequence ")
+         print("in order to waste less memory on indexes.")
       end
-      return treeSize, pathSize
    end
-   for parentIdx=1,self.parentIds:size(1) do
-      local parentId = self.parentIds[parentIdx]
-      local treeSize, pathSize = getSize(parentId)
-      maxFamilyPath = math.max(treeSize, maxFamilyPath)
-      maxDept = math.max(pathSize, maxDept)
-   end
-   self.maxFamilyPath = maxFamilyPath
-   self.maxDept = maxDept
+end
 
+-- buffers and bookkeeping shared by the constructor and loadBinary
+function SoftMaxTree:initBuffers(static)
    -- stores the parentIds of nodes that have been accGradParameters
    self.updates = {}
 
    -- used internally to store intermediate outputs or gradOutputs
-   self._nodeBuffer = torch.Tensor()
-   self._multiBuffer = torch.Tensor()
+   self._nodeBuffer = self.weight.new()
+   self._multiBuffer = self.weight.new()
+   -- where the path of each row starts in _multiBuffer
+   self._multiOffsets = torch.LongTensor()
+   -- used by the node-grouped forward (see groupNodes)
+   self._groupInput = self.weight.new()
+   self._groupOutput = self.weight.new()
 
    self.batchSize = 0
 
-   self._gradInput = torch.Tensor()
+   self._gradInput = self.weight.new()
    self._gradTarget = torch.IntTensor() -- dummy
    self.gradInput = {self._gradInput, self._gradTarget}
    self.static = (static == nil) and true or static
+end
 
-   self:reset()
+-- Rebuilds the index, with its path table, for modules serialized
+-- before pathTable existed. The children of each parent are contiguous
+-- in childIds, in the order of the rows of weight, which the rebuilt
+-- index keeps.
+function SoftMaxTree:buildPaths()
+   local childIds = self.childIds
+   local edges = torch.IntTensor(childIds:size(1), 2)
+   edges:select(2,1):copy(childIds)
+   edges:select(2,2):copy(self.childParent:select(2,1):index(1, childIds:long()))
+   torch.Tensor().nn.SoftMaxTree_buildIndex(self, edges)
+end
+
+-- Builds a hierarchy for nn.SoftMaxTree from the frequencies of the 
+-- classes (a 1D tensor or table, class i becomes leaf nodeId i) such 
+-- that frequent classes get short paths. Options (all optional) :
+--   maxFanout  : max number of children per parent (default 32)
+--   mode       : 'huffman' (k-ary Huffman tree, default) or 'balanced' 
+--                (recursively split into maxFanout groups of equal mass)
+--   embeddings : nClass x dim tensor. In balanced mode, the classes of 
+--                a parent are ordered by their coordinate of largest 
+--                variance before splitting, so that siblings are close.
+--   inputSize  : used to report the expected addmv FLOPs per sample
+-- Returns hierarchy, rootId, report where report holds the expected 
+-- depth and number of weight rows (sum of nChildren) per sample, the 
+-- expected FLOPs (2*rows*inputSize), maxDept and maxFamilyPath.
+function SoftMaxTree.buildHierarchy(frequencies, options)
+   options = options or {}
+   local maxFanout = options.maxFanout or 32
+   local mode = options.mode or 'huffman'
+   local embeddings = options.embeddings
+   assert(maxFanout >= 2, "maxFanout should be at least 2")
+   if torch.isTensor(frequencies) then
+      frequencies = frequencies:double():totable()
+   end
+   local nClass = #frequencies
+   assert(nClass > 0, "Expecting at least one class")
+   
+   local hierarchy = {}
+   local nextId = nClass
+   local function newParent(children)
+      nextId = nextId + 1
+      hierarchy[nextId] = torch.IntTensor(children)
+      return nextId
+   end
+   
+   local classes = {}
+   for i=1,nClass do
+      classes[i] = i
+   end
+   table.sort(classes, function(a, b) 
+      if frequencies[a] ~= frequencies[b] then
+         return frequencies[a] > frequencies[b]
+      end
+      return a < b
+   end)
+   
+   local rootId
+   if mode == 'huffman' then
+      -- nodes are merged by increasing mass. Merged nodes come out in 
+      -- increasing order of mass, so two queues replace the heap.
+      local leaves, merged = {}, {}
+      for i=nClass,1,-1 do
+         table.insert(leaves, {id=classes[i], mass=frequencies[classes[i]]})
+      end
+      local li, mi = 1, 1
+      local function pop()
+         local leaf, node = leaves[li], merged[mi]
+         if leaf and (not node or leaf.mass <= node.mass) then
+            li = li + 1
+            return leaf
+         end
+         mi = mi + 1
+         return node
+      end
+      local nNode = nClass
+      -- the first merge takes the remainder, such that all other 
+      -- parents have exactly maxFanout children
+      local nMerge = nClass > maxFanout and (nClass-2)%(maxFanout-1) + 2 or nClass
+      while true do
+         local children, mass = {}, 0
+         for j=1,nMerge do
+            local node = pop()
+            table.insert(children, node.id)
+            mass = mass + node.mass
+         end
+         local parentId = newParent(children)
+         nNode = nNode - nMerge + 1
+         if nNode == 1 then
+            rootId = parentId
+            break
+         end
+         table.insert(merged, {id=parentId, mass=mass})
+         nMerge = math.min(maxFanout, nNode)
+      end
+   elseif mode == 'balanced' then
+      local function split(items)
+         if embeddings and #items > maxFanout then
+            -- order by the coordinate of largest variance
+            local idx = torch.LongTensor(items)
+            local emb = embeddings:index(1, idx)
+            local _, dim = emb:var(1):view(-1):max(1)
+            local coord = emb:select(2, dim[1])
+            local order = {}
+            for j=1,#items do
+               order[j] = j
+            end
+            table.sort(order, function(a, b) return coord[a] < coord[b] end)
+            local sorted = {}
+            for j=1,#items do
+               sorted[j] = items[order[j]]
+            end
+            items = sorted
+         end
+         local n = #items
+         local nChunk = math.min(maxFanout, n)
+         local total = 0
+         for j=1,n do
+            total = total + frequencies[items[j]]
+         end
+         local chunks, chunk, acc = {}, {}, 0
+         for j=1,n do
+            table.insert(chunk, items[j])
+            acc = acc + frequencies[items[j]]
+            local nLeft = nChunk - #chunks - 1
+            if nLeft > 0 and (acc >= total*(#chunks+1)/nChunk or n - j == nLeft) then
+               table.insert(chunks, chunk)
+               chunk = {}
+            end
+         end
+         table.insert(chunks, chunk)
+         local children = {}
+         for j, chunk in ipairs(chunks) do
+            children[j] = (#chunk == 1) and chunk[1] or split(chunk)
+         end
+         return newParent(children)
+      end
+      rootId = split(classes)
+   else
+      error("Unknown mode : "..tostring(mode)..", expecting huffman | balanced")
+   end
+   
+   -- expected cost of a sample, weighted by the class frequencies
+   local childParent = {}
+   for parentId, children in pairs(hierarchy) do
+      for j=1,children:size(1) do
+         childParent[children[j]] = parentId
+      end
+   end
+   local total, depth, rows = 0, 0, 0
+   local maxDept, maxFamilyPath = 0, 0
+   for classId=1,nClass do
+      local d, r = 0, 0
+      local nodeId = classId
+      while nodeId ~= rootId do
+         nodeId = childParent[nodeId]
+         d = d + 1
+         r = r + hierarchy[nodeId]:size(1)
+      end
+      local freq = frequencies[classId]
+      total = total + freq
+      depth = depth + freq*d
+      rows = rows + freq*r
+      maxDept = math.max(maxDept, d)
+      maxFamilyPath = math.max(maxFamilyPath, r)
+   end
+   total = (total > 0) and total or 1
+   local report = {
+      expectedDepth = depth/total,
+      expectedRows = rows/total,
+      maxDept = maxDept,
+      maxFamilyPath = maxFamilyPath,
+      nParent = nextId - nClass
+   }
+   if options.inputSize then
+      report.expectedFlops = 2*report.expectedRows*options.inputSize
+      report.flatFlops = 2*nClass*options.inputSize
+   end
+   return hierarchy, rootId, report
+end
+
+-- Compact binary format, made of two files of native binary data :
+-- prefix.tree : int32 header {magic, version, inputSize, rootId, nEdge, 
+--    elementSize} followed by the nEdge x 2 {childId, parentId} edges, 
+--    in the order of the rows of weight.
+-- prefix.weight : weight (nChildNode x inputSize) followed by bias 
+--    (nChildNode), as float (elementSize 4) or double (elementSize 8).
+-- The magic doubles as byte-order marker : its 4 bytes are distinct, so a 
+-- file written with the other byte order reads as binarySwappedMagic.
+local binaryMagic, binaryVersion = 0x534d5454, 1
+local binarySwappedMagic = 0x54544d53
+
+function SoftMaxTree:saveBinary(prefix)
+   local weight, bias = self.weight, self.bias
+   local elementSize = weight:storage():elementSize()
+   assert(torch.type(weight) == 'torch.FloatTensor' or torch.type(weight) == 'torch.DoubleTensor', 
+      "saveBinary expects float or double parameters")
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   
+   local edges = torch.IntTensor(self.nChildNode, 2)
+   edges:select(2,1):copy(self.childIds)
+   edges:select(2,2):copy(self.childParent:select(2,1):index(1, self.childIds:long()))
+   local header = torch.IntStorage{
+      binaryMagic, binaryVersion, self.inputSize, self.rootId, self.nChildNode, elementSize
+   }
+   
+   local file = torch.DiskFile(prefix..'.tree', 'w'):binary()
+   file:writeInt(header)
+   file:writeInt(edges:storage())
+   file:close()
+   
+   local function storage(tensor)
+      tensor = tensor:contiguous()
+      if tensor:storageOffset() ~= 1 or tensor:storage():size() ~= tensor:nElement() then
+         tensor = tensor:clone()
+      end
+      return tensor:storage()
+   end
+   file = torch.DiskFile(prefix..'.weight', 'w'):binary()
+   local write = (elementSize == 4) and file.writeFloat or file.writeDouble
+   write(file, storage(weight))
+   write(file, storage(bias))
+   file:close()
+end
+
+-- Loads a module saved with saveBinary. Both files are memory-mapped 
+-- (privately, unless shared is true, in which case updates to the 
+-- parameters are written back to the file), such that the parameters 
+-- are paged in on demand. The tree index is rebuilt in C from the edges.
+function SoftMaxTree.loadBinary(prefix, accUpdate, static, shared)
+   local tree = torch.IntStorage(prefix..'.tree', shared or false)
+   assert(tree:size() >= 6, prefix..".tree is not a SoftMaxTree file")
+   assert(tree[1] ~= binarySwappedMagic, prefix..".tree was saved with the other byte order")
+   assert(tree[1] == binaryMagic, prefix..".tree is not a SoftMaxTree file")
+   assert(tree[2] == binaryVersion, "Unsupported SoftMaxTree file version : "..tree[2])
+   local inputSize, rootId, nEdge, elementSize = tree[3], tree[4], tree[5], tree[6]
+   assert(inputSize > 0, prefix..".tree has an invalid inputSize : "..inputSize)
+   assert(nEdge > 0, prefix..".tree has an invalid number of edges : "..nEdge)
+   assert(elementSize == 4 or elementSize == 8, 
+      prefix..".tree has an invalid elementSize : "..elementSize)
+   assert(tree:size() == 6 + 2*nEdge, prefix..".tree is truncated")
+   local edges = torch.IntTensor(tree, 7, torch.LongStorage{nEdge, 2})
+   
+   local Tensor, Storage
+   if elementSize == 4 then
+      Tensor, Storage = torch.FloatTensor, torch.FloatStorage
+   else
+      Tensor, Storage = torch.DoubleTensor, torch.DoubleStorage
+   end
+   local params = Storage(prefix..'.weight', shared or false)
+   assert(params:size() == nEdge*(inputSize+1), prefix..".weight doesn't match "..prefix..".tree")
+   
+   local self = torch.factory('nn.SoftMaxTree')()
+   parent.__init(self)
+   self.rootId = rootId
+   self.inputSize = inputSize
+   self.accUpdate = accUpdate
+   self:buildIndex(edges)
+   
+   self.weight = Tensor(params, 1, torch.LongStorage{nEdge, inputSize})
+   self.bias = Tensor(params, nEdge*inputSize+1, torch.LongStorage{nEdge})
+   if not self.accUpdate then
+      self.gradWeight = self.weight.new():resizeAs(self.weight):zero()
+      self.gradBias = self.bias.new():resizeAs(self.bias):zero()
+   end
+   self:initBuffers(static)
+   return self
 end
 
 function SoftMaxTree:reset(stdv)
@@ -155,11 +376,34 @@ function SoftMaxTree:reset(stdv)
 end
 
 function SoftMaxTree:updateOutput(inputTable)
+   assert(self.quantized or not self.weightDropped, "float weight was dropped by quantize(mode, true)")
    local input, target = unpack(inputTable)
+   self:prepareBuffers(input, target)
+   if self.quantized then
+      return input.nn.SoftMaxTree_updateOutputQuantized(self, input, target)
+   end
+   if self.grouped and torch.type(input) ~= 'torch.CudaTensor' then
+      self._groupInput = self._groupInput or input.new()
+      self._groupOutput = self._groupOutput or input.new()
+      return input.nn.SoftMaxTree_updateOutputGrouped(self, input, target)
+   end
+   return input.nn.SoftMaxTree_updateOutput(self, input, target)
+end
+
+-- sets up the buffers of a forward (also used by SoftMaxForest)
+function SoftMaxTree:prepareBuffers(input, target)
+   if not self.pathTable then
+      self:buildPaths()
+   end
+   self._multiOffsets = self._multiOffsets or torch.LongTensor()
    -- buffers:
    if self.batchSize ~= input:size(1) then
       self._nodeBuffer:resize(self.maxFamily)
-      self._multiBuffer:resize(input:size(1)*self.maxFamilyPath)
+      if torch.type(input) == 'torch.CudaTensor' then
+         -- cunnx uses a fixed stride of maxFamilyPath per row. 
+         -- The C kernels resize it to the paths of each batch.
+         self._multiBuffer:resize(input:size(1)*self.maxFamilyPath)
+      end
       self.batchSize = input:size(1)
       -- so that it works within nn.ConcatTable :
       self._gradTarget:resizeAs(target):zero()
@@ -168,10 +412,117 @@ function SoftMaxTree:updateOutput(inputTable)
          self._nodeUpdateCuda:resize(input:size(1),self.maxDept)
       end
    end
-   return input.nn.SoftMaxTree_updateOutput(self, input, target)
+end
+
+-- When grouped is true, the forward first buckets the rows of the batch
+-- by the parent nodes on their paths, and then evaluates each touched 
+-- parent with a single matrix-matrix product over all the rows that 
+-- visit it. Worth it for large batches, where the top of the tree is 
+-- shared by most rows. The backward is unaffected.
+function SoftMaxTree:groupNodes(grouped)
+   self.grouped = (grouped == nil) and true or grouped
+   return self
+end
+
+-- Inference-only mode where the forward reads a reduced-precision copy 
+-- of weight (qweight) : 'int8' (default) stores each row as a CharTensor 
+-- with one scale per row (qscale), 'half' stores IEEE half-precision 
+-- floats in a ShortTensor. The dot products dequantize on the fly, such 
+-- that 1/4 (int8) or 1/2 (half) of the float weight bytes are read.
+-- When dropWeight is true, the float weight and gradWeight are released, 
+-- and the module can only be used for the quantized forward (weightDropped).
+-- Otherwise, call quantize() again after updating the parameters, or 
+-- quantize(false) to get back to the float forward.
+function SoftMaxTree:quantize(mode, dropWeight)
+   if mode == false then
+      assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+      self.quantized = nil
+      self.qweight = nil
+      self.qscale = nil
+      return self
+   end
+   mode = mode or 'int8'
+   assert(torch.type(self.weight) ~= 'torch.CudaTensor', "quantize only supports CPU tensors")
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   if mode == 'int8' then
+      self.qweight = torch.CharTensor()
+      self.qscale = self.weight.new()
+   elseif mode == 'half' then
+      self.qweight = torch.ShortTensor()
+      self.qscale = nil
+   else
+      error("Unknown quantization mode : "..tostring(mode)..", expecting int8 | half")
+   end
+   self.weight.nn.SoftMaxTree_quantize(self, mode)
+   self.quantized = mode
+   if dropWeight then
+      self.weight = self.weight.new()
+      self.gradWeight = nil
+      self.weightDropped = true
+   end
+   return self
+end
+
+-- Compares the output of the quantized forward to that of the float 
+-- forward for a batch of inputs and targets. Returns a table of the 
+-- max and mean absolute deltas of the log-likelihoods, the max delta 
+-- of the likelihoods, and the bytes of weight and qweight (+ qscale).
+function SoftMaxTree:quantizationReport(inputTable)
+   assert(self.quantized, "call quantize() first")
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   local quantized = self.quantized
+   self.quantized = nil
+   local output = self:updateOutput(inputTable):clone()
+   self.quantized = quantized
+   local qoutput = self:updateOutput(inputTable)
+   local delta = (qoutput - output):abs()
+   local report = {
+      mode = quantized,
+      maxDelta = delta:max(),
+      meanDelta = delta:mean(),
+      maxProbDelta = (torch.exp(qoutput) - torch.exp(output)):abs():max(),
+      weightBytes = self.weight:nElement()*self.weight:storage():elementSize(),
+      qweightBytes = self.qweight:nElement()*self.qweight:storage():elementSize()
+   }
+   if self.qscale then
+      report.qweightBytes = report.qweightBytes + self.qscale:nElement()*self.qscale:storage():elementSize()
+   end
+   return report
+end
+
+-- Returns the k most likely leaves of each row of the input (a 2D 
+-- tensor, no targets), as a batchSize x k tensor of log-likelihoods 
+-- (in decreasing order) and a batchSize x k IntTensor of leaf ids. 
+-- The tree is searched best-first, so only the nodes that can lead 
+-- to one of the k best leaves are evaluated.
+function SoftMaxTree:topk(input, k)
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   k = k or 1
+   if not self.pathTable then
+      self:buildPaths()
+   end
+   self._topkOutput = self._topkOutput or input.new()
+   self._topkIndices = self._topkIndices or torch.IntTensor()
+   input.nn.SoftMaxTree_topk(self, input, k)
+   return self._topkOutput, self._topkIndices
+end
+
+-- Returns the log-likelihood of every node of the tree for each row 
+-- of the input (a 2D tensor, no targets), as a batchSize x maxChildId 
+-- tensor indexed by nodeId. Slots that aren't nodes contain -inf.
+function SoftMaxTree:fullOutput(input)
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   if not self.pathTable then
+      self:buildPaths()
+   end
+   self._fullBuffer = self._fullBuffer or input.new()
+   self._fullOutput = self._fullOutput or input.new()
+   input.nn.SoftMaxTree_fullOutput(self, input)
+   return self._fullOutput
 end
 
 function SoftMaxTree:updateGradInput(inputTable, gradOutput)
+   assert(not self.quantized, "quantized SoftMaxTree is inference-only")
    local input, target = unpack(inputTable)
    if not gradOutput:isContiguous() and torch.type(gradOutput) == 'torch.CudaTensor' then
       self._gradOutput = self._gradOutput or gradOutput.new()
@@ -185,6 +536,7 @@ function SoftMaxTree:updateGradInput(inputTable, gradOutput)
 end
 
 function SoftMaxTree:accGradParameters(inputTable, gradOutput, scale)
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
    local input, target = unpack(inputTable)
    gradOutput = self._gradOutput or gradOutput
    scale = scale or 1
@@ -194,6 +546,7 @@ end
 -- when static is true, return parameters with static keys
 -- i.e. keys that don't change from batch to batch
 function SoftMaxTree:parameters()
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
    local static = self.static
    local params, grads = {}, {}
    local updated = false
@@ -242,7 +595,12 @@ function SoftMaxTree:parameters()
 end
 
 function SoftMaxTree:updateParameters(learningRate)
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
    assert(not self.accUpdate)
+   if self.weight.nn.SoftMaxTree_sparseStep then
+      self.weight.nn.SoftMaxTree_sparseStep(self, learningRate)
+      return
+   end
    local params, gradParams = self:parameters()
    if params then
       for k,param in pairs(params) do
@@ -266,6 +624,11 @@ function SoftMaxTree:getNodeParameters(parentId)
 end
 
 function SoftMaxTree:zeroGradParameters()
+   assert(not self.weightDropped, "float weight was dropped by quantize(mode, true)")
+   if self.weight.nn.SoftMaxTree_sparseStep and not self.accUpdate then
+      self.weight.nn.SoftMaxTree_sparseStep(self, 0, 0, 0, true)
+      return
+   end
    local _,gradParams = self:parameters()
    for k,gradParam in pairs(gradParams) do
       gradParam:zero()
@@ -296,10 +659,18 @@ function SoftMaxTree:type(type, typecache)
    self.childParentCuda = nil
    local _gradTarget = self._gradTarget
    self._gradTarget = nil
+   local qweight = self.qweight
+   self.qweight = nil
+   self._topkIndices = nil
+   self._multiOffsets = nil
    local childIds = self.childIds
    self.childIds = nil
    local parentIds = self.parentIds
    self.parentIds = nil
+   local pathTable = self.pathTable
+   self.pathTable = nil
+   local childPath = self.childPath
+   self.childPath = nil
    self._gradOutput = nil
 
    parent.type(self, type, typecache)
@@ -308,8 +679,11 @@ function SoftMaxTree:type(type, typecache)
    self.parentChildren = parentChildren
    self.childParent = childParent
    self._gradTarget = _gradTarget
+   self.qweight = qweight
    self.childIds = childIds
    self.parentIds = parentIds
+   self.pathTable = pathTable
+   self.childPath = childPath
 
    if (type == 'torch.CudaTensor') then
       -- cunnx needs this for filling self.updates
@@ -333,6 +707,10 @@ function SoftMaxTree:type(type, typecache)
 end
 
 function SoftMaxTree:maxNorm(maxNorm)
+   if self.weight.nn.SoftMaxTree_sparseStep then
+      self.weight.nn.SoftMaxTree_sparseStep(self, 0, 0, maxNorm or 0)
+      return
+   end
    local params = self:parameters()
    if params then
       for k,param in pairs(params) do
@@ -348,7 +726,10 @@ function SoftMaxTree:momentumGradParameters()
    local _ = require 'moses'
    if not self.momGradParams or _.isEmpty(self.momGradParams) then
       assert(not self.accUpdate, "cannot use momentum with accUpdate")
-      self.momGradParams = {self.gradWeight:clone():zero(), self.gradBias:clone():zero()}
+      self.momGradParams = {
+         self.gradWeight.new():resizeAs(self.gradWeight):zero(), 
+         self.gradBias.new():resizeAs(self.gradBias):zero()
+      }
    end
    local momGradParams = self.momGradParams
    if self.static and not _.isEmpty(self.updates) then
@@ -368,5 +749,41 @@ function SoftMaxTree:momentumGradParameters()
    return momGradParams
 end
 
+-- Fused optimizer step over the parents touched since the last 
+-- zeroGradParameters : SGD with optional momentum (the velocities are 
+-- kept in momGradParams) and max-norm constraint on the rows of weight. 
+-- The gradients of the touched parents are zeroed in the same pass, 
+-- such that no zeroGradParameters is needed before the next backward.
+function SoftMaxTree:sparseUpdate(learningRate, momentum, maxNorm)
+   assert(not self.accUpdate, "cannot use sparseUpdate with accUpdate")
+   momentum = momentum or 0
+   local momGradWeight, momGradBias
+   if momentum ~= 0 then
+      if not (self.momGradParams and self.momGradParams[1]) then
+         self.momGradParams = {
+            self.gradWeight.new():resizeAs(self.gradWeight):zero(), 
+            self.gradBias.new():resizeAs(self.gradBias):zero()
+         }
+      end
+      momGradWeight, momGradBias = self.momGradParams[1], self.momGradParams[2]
+   end
+   if not self.weight.nn.SoftMaxTree_sparseStep then
+      -- e.g. CudaTensor
+      if momentum ~= 0 then
+         momGradWeight:mul(momentum):add(self.gradWeight)
+         momGradBias:mul(momentum):add(self.gradBias)
+         self.gradWeight:copy(momGradWeight)
+         self.gradBias:copy(momGradBias)
+      end
+      self:updateParameters(learningRate)
+      if maxNorm then
+         self:maxNorm(maxNorm)
+      end
+      self:zeroGradParameters()
+      return
+   end
+   self.weight.nn.SoftMaxTree_sparseStep(self, learningRate, momentum, maxNorm or 0, true, momGradWeight, momGradBias)
+end
+
 -- we do not need to accumulate parameters when sharing
 SoftMaxTree.sharedAccUpdateGradParameters = SoftMaxTree.accUpdateGradParameters
@@ -7,7 +7,13 @@ maps.
 The input is a 3D tensor width x height x nInputPlane, the
 output is a 3D tensor width x height x 2. The first slice
 of the output contains horizontal edges, the second vertical
-edges.
+edges. A 4D input is processed as a batch of such tensors.
+
+With connex == 8, the output has 2 more slices: the edges to
+the bottom-right and to the bottom-left neighbors. Any other
+set of edges can be given as a stencil, a list of {dx,dy}
+offsets: slice i then links each pixel (y,x) to its neighbor
+(y+dy,x+dx).
 
 The input features are assumed to be >= 0.
 More precisely:
@@ -19,6 +25,12 @@ More precisely:
   are properly considered as being similar.
 ]]
 
+-- the {dx,dy} offsets of the edges of each connexity
+SpatialGraph.stencils = {
+   [4] = {{1,0}, {0,1}},
+   [8] = {{1,0}, {0,1}, {1,1}, {-1,1}}
+}
+
 function SpatialGraph:__init(...)
    parent.__init(self)
 
@@ -27,23 +39,38 @@ function SpatialGraph:__init(...)
       'nn.SpatialGraph',  help_desc,
       {arg='dist', type='string', help='distance metric to use', default='euclid'},
       {arg='normalize', type='boolean', help='normalize euclidean distances btwn 0 and 1 (assumes input range to be btwn 0 and 1)', default=true},
-      {arg='connex', type='number', help='connexity', default=4}
+      {arg='connex', type='number', help='connexity (4 or 8)', default=4},
+      {arg='stencil', type='table', help='list of {dx,dy} neighbor offsets (overrides connex)'}
    )
    
-   if self.connex ~= 4 then
-      xlua.error('4 is the only connexity supported, for now', 'nn.SpatialGraph',self.usage)
+   local stencil = self.stencil or SpatialGraph.stencils[self.connex]
+   if not stencil then
+      xlua.error('4 and 8 are the only connexities supported', 'nn.SpatialGraph',self.usage)
+   end
+   self.stencil = torch.LongTensor(stencil)
+   if self.stencil:dim() ~= 2 or self.stencil:size(2) ~= 2 then
+      xlua.error('the stencil must be a list of {dx,dy} offsets', 'nn.SpatialGraph',self.usage)
    end
+   self.connex = 2*self.stencil:size(1)
    self.dist = ((self.dist == 'euclid') and 0) or ((self.dist == 'cosine') and 1)
       or xerror('euclid is the only distance supported, for now','nn.SpatialGraph',self.usage)
    self.normalize = (self.normalize and 1) or 0
-   if self.dist == 'cosine' and self.normalize == 1 then
-      xerror('normalized cosine is not supported for now [just because I couldnt figure out the gradient :-)]',
-             'nn.SpatialGraph', self.usage)
-   end
 end
 
 function SpatialGraph:updateOutput(input)
-   self.output:resize(self.connex / 2, input:size(2), input:size(3))
+   -- (type() converts the stencil along with the other tensors)
+   self.stencil = self.stencil and self.stencil:long() or torch.LongTensor(SpatialGraph.stencils[self.connex])
+   if input:dim() == 4 then
+      self.output:resize(input:size(1), self.stencil:size(1), input:size(3), input:size(4))
+   else
+      self.output:resize(self.stencil:size(1), input:size(2), input:size(3))
+   end
+   if self.dist == 1 then
+      -- squared norms of the pixels and dot products of the edges,
+      -- computed by the forward and reused by the backward
+      self.norms = self.norms or input.new()
+      self.dots = self.dots or input.new()
+   end
    input.nn.SpatialGraph_updateOutput(self, input)
    return self.output
 end
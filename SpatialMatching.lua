@@ -1,11 +1,19 @@
 local SpatialMatching, parent = torch.class('nn.SpatialMatching', 'nn.Module')
 
-function SpatialMatching:__init(maxh, maxw, full_output)
+function SpatialMatching:__init(maxh, maxw, full_output, mode)
    -- If full_output is false, output is computed on elements of the first input
    -- for which all the possible corresponding elements exist in the second input
    -- In addition, if full_output is set to false, the pixel (1,1) of the first input
    -- is supposed to correspond to the pixel (maxh/2, maxw/2) of the second one
+   -- mode is one of :
+   --   'l2' (default) : squared L2 distances, computed pair by pair
+   --   'gemm' : the same distances, as ||a||^2 + ||b||^2 - 2*a.b with the
+   --            cross terms computed by BLAS (faster for large windows)
+   --   'correlation' : the dot products a.b, computed by BLAS
    parent.__init(self)
+   self.mode = mode or 'l2'
+   assert(self.mode == 'l2' or self.mode == 'gemm' or self.mode == 'correlation',
+          'SpatialMatching: unknown mode ' .. tostring(self.mode))
    self.maxw = maxw or 11
    self.maxh = maxh or 11
    if full_output == nil then
@@ -16,18 +24,147 @@ function SpatialMatching:__init(maxh, maxw, full_output)
    self.gradInput2 = torch.Tensor()
 end
 
+-- Only keeps the k best matches of each pixel (smallest distances, or
+-- largest correlations), instead of the dense HxWxmaxhxmaxw volume.
+-- The output is then HxWxk, sorted from the best match, and self.offsets
+-- is a HxWxkx2 ShortTensor of their (dy,dx) in the window, such that
+-- output[y][x][i] is the dense output[y][x][dy][dx].
+-- keepBest() goes back to the dense output.
+function SpatialMatching:keepBest(k)
+   self.k = k
+   self._pyramidK = nil
+   return self
+end
+
+-- Coarse-to-fine search: the inputs are halved levels times (with
+-- nn.SpatialDownSampling), the whole (halved) window is only searched at
+-- the coarsest level, and each finer level only searches within radius
+-- (default 2) of twice the best displacement found at the coarser level.
+-- The output is the one of keepBest(k) (k = 1 unless set), and the
+-- gradients flow through the matches found at full resolution.
+-- pyramid() goes back to the exhaustive search, and to the dense output
+-- unless keepBest(k) was called.
+function SpatialMatching:pyramid(levels, radius)
+   self.levels = levels
+   self.radius = radius or 2
+   if levels and not self.k then
+      self.k = 1
+      self._pyramidK = true
+   elseif not levels and self._pyramidK then
+      self.k = nil
+      self._pyramidK = nil
+   end
+   return self
+end
+
+function SpatialMatching:_pyramidOutput(input)
+   local in1, in2 = input[1], input[2]
+   assert(in1:dim() == 3, 'SpatialMatching: the pyramid search expects 3D inputs')
+   local offh, offw = 0, 0
+   if self.full_output then
+      offh, offw = math.ceil(self.maxh/2)-1, math.ceil(self.maxw/2)-1
+   end
+   -- bounds of y2,x2 (see updateOutput)
+   local h2 = self.full_output and in1:size(2) or in2:size(2)
+   local w2 = self.full_output and in1:size(3) or in2:size(3)
+
+   -- levels, from full resolution
+   self._pyramid = self._pyramid or {}
+   local levels = {}
+   for l = 1,self.levels+1 do
+      local level
+      if l == 1 then
+         level = {output = self.output, offsets = self.offsets,
+                  packed1 = self._packed1, packed2 = self._packed2}
+      else
+         level = self._pyramid[l]
+         if not level or torch.typename(level.output) ~= torch.typename(in1) then
+            level = {down1 = nn.SpatialDownSampling(2, 2):type(in1:type()),
+                     down2 = nn.SpatialDownSampling(2, 2):type(in1:type()),
+                     output = in1.new(), offsets = torch.ShortTensor(),
+                     packed1 = in1.new(), packed2 = in1.new()}
+            self._pyramid[l] = level
+         end
+         in1 = level.down1:updateOutput(in1)
+         in2 = level.down2:updateOutput(in2)
+         h2, w2 = math.floor(h2/2), math.floor(w2/2)
+      end
+      local scale = 2^(l-1)
+      level.input1, level.input2 = in1, in2
+      level.h2, level.w2 = h2, w2
+      level.dymin = math.floor(-offh/scale)
+      level.dymax = math.ceil((self.maxh-1-offh)/scale)
+      level.dxmin = math.floor(-offw/scale)
+      level.dxmax = math.ceil((self.maxw-1-offw)/scale)
+      levels[l] = level
+   end
+
+   -- search, from the coarsest level
+   local coarse
+   for l = #levels,1,-1 do
+      local level = levels[l]
+      in1.nn.SpatialMatching_pyramidOutput(level.input1, level.input2, level.output, level.offsets,
+                                           level.packed1, level.packed2,
+                                           level.dymin, level.dymax, level.dxmin, level.dxmax,
+                                           level.h2, level.w2, (l == 1) and self.k or 1,
+                                           self.mode == 'correlation',
+                                           coarse and coarse.offsets, coarse and coarse.dymin,
+                                           coarse and coarse.dxmin, self.radius)
+      coarse = level
+   end
+   return self.output
+end
+
+-- Inference only: output is the HxWx2 (dy,dx) of the best match of each
+-- pixel (1-based, as in the dense output), self.subpixel the HxWx2 parabolic
+-- refinement of these (in [-0.5,0.5]), and self.ratio the HxW ratio of the
+-- best to the second best cost (the lower, the more reliable the match).
+-- The cost volume is never allocated. winnerTakeAll(false) to disable.
+function SpatialMatching:winnerTakeAll(wta)
+   self.wta = (wta ~= false)
+   return self
+end
+
 function SpatialMatching:updateOutput(input)
-   -- input is a table of 2 inputs, each one being KxHxW
+   -- input is a table of 2 inputs, each one being KxHxW (or NxKxHxW batches)
    -- if not full_output, the 1st one is KxH1xW1 where H1 <= H-maxh+1, W1 <= W-maxw+1
-   self.output:resize(input[1]:size(2), input[1]:size(3), self.maxh, self.maxw)
+   -- channels-last copies of the inputs (HxWxK)
+   self._packed1 = self._packed1 or input[1].new()
+   self._packed2 = self._packed2 or input[2].new()
+   if self.wta then
+      self.subpixel = self.subpixel or input[1].new()
+      self.ratio = self.ratio or input[1].new()
+      input[1].nn.SpatialMatching_updateOutputWTA(self, input[1], input[2])
+      return self.output
+   end
+   if self.k then
+      if torch.typename(self.offsets) ~= 'torch.ShortTensor' then
+         self.offsets = torch.ShortTensor() -- also after type()
+      end
+      if self.levels and self.levels > 0 then
+         return self:_pyramidOutput(input)
+      end
+      input[1].nn.SpatialMatching_updateOutputTopk(self, input[1], input[2])
+      return self.output
+   end
+   if input[1]:dim() == 4 then
+      self.output:resize(input[1]:size(1), input[1]:size(3), input[1]:size(4), self.maxh, self.maxw)
+   else
+      self.output:resize(input[1]:size(2), input[1]:size(3), self.maxh, self.maxw)
+   end
    input[1].nn.SpatialMatching_updateOutput(self, input[1], input[2])
    return self.output
 end
 
 function SpatialMatching:updateGradInput(input, gradOutput)
+   assert(not self.wta, 'SpatialMatching: winner-take-all output has no gradient')
    self.gradInput1:resize(input[1]:size()):zero()
    self.gradInput2:resize(input[2]:size()):zero()
-   input[1].nn.SpatialMatching_updateGradInput(self, input[1], input[2], gradOutput)
+   if self.k then
+      input[1].nn.SpatialMatching_updateGradInputTopk(self, input[1], input[2], gradOutput)
+   else
+      input[1].nn.SpatialMatching_updateGradInput(self, input[1], input[2], gradOutput)
+   end
    self.gradInput = {self.gradInput1, self.gradInput2}
    return self.gradInput
 end
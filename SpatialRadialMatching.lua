@@ -11,23 +11,43 @@ function SpatialRadialMatching:__init(maxh)
    self.gradInput2 = torch.Tensor()
 end
 
+-- Inference only: output is the HxW dy of the best match of each pixel
+-- (1-based, as in the dense output), self.subpixel its HxW parabolic
+-- refinement (in [-0.5,0.5]), and self.ratio the HxW ratio of the best
+-- to the second best cost (the lower, the more reliable the match).
+-- The cost volume is never allocated. winnerTakeAll(false) to disable.
+function SpatialRadialMatching:winnerTakeAll(wta)
+   self.wta = (wta ~= false)
+   return self
+end
+
 function SpatialRadialMatching:updateOutput(input)
-   -- input is a table of 2 inputs, each one being KxHxW
+   -- input is a table of 2 inputs, each one being KxHxW (or NxKxHxW batches)
    -- if not full_output, the 1st one is KxH1xW1 where H1 <= H-maxh+1, W1 <= W-maxw+1
-   self.output:resize(input[1]:size(2), input[1]:size(3), self.maxh)
-   --if input[3] == nil then
-   --   input[3] = torch.LongTensor(input[1]:size(2), input[1]:size(3)):fill(1)
-   --end
-   --input[1].nn.SpatialRadialMatching_updateOutput(self, input[1], input[2], input[3])
-   input[1].nn.SpatialRadialMatching_updateOutput(self, input[1], input[2])
+   -- An optional 3rd input restricts the matching to some pixels of the 1st one:
+   -- either a ByteTensor mask, HxW (NxHxW for batches, nonzero = active), or a
+   -- LongTensor of 1-based coordinates, Mx2 (y,x) (Mx3 (n,y,x) for batches).
+   -- Inactive pixels output 0 and get no gradient.
+   if self.wta then
+      self.subpixel = self.subpixel or input[1].new()
+      self.ratio = self.ratio or input[1].new()
+      input[1].nn.SpatialRadialMatching_updateOutputWTA(self, input[1], input[2], input[3])
+      return self.output
+   end
+   if input[1]:dim() == 4 then
+      self.output:resize(input[1]:size(1), input[1]:size(3), input[1]:size(4), self.maxh)
+   else
+      self.output:resize(input[1]:size(2), input[1]:size(3), self.maxh)
+   end
+   input[1].nn.SpatialRadialMatching_updateOutput(self, input[1], input[2], input[3])
    return self.output
 end
 
 function SpatialRadialMatching:updateGradInput(input, gradOutput)
+   assert(not self.wta, 'SpatialRadialMatching: winner-take-all output has no gradient')
    self.gradInput1:resize(input[1]:size()):zero()
    self.gradInput2:resize(input[2]:size()):zero()
-   --input[1].nn.SpatialRadialMatching_updateGradInput(self,input[1],input[2],gradOutput,input[3])
-input[1].nn.SpatialRadialMatching_updateGradInput(self,input[1],input[2],gradOutput)
+   input[1].nn.SpatialRadialMatching_updateGradInput(self,input[1],input[2],gradOutput,input[3])
    self.gradInput = {self.gradInput1, self.gradInput2}
    return self.gradInput
 end
@@ -2,6 +2,11 @@ local SpatialReSamplingEx, parent = torch.class('nn.SpatialReSamplingEx', 'nn.Mo
 
 local help_desc = [[
       Extended spatial resampling.
+
+      Modes bicubic, lanczos and area are separable filters, with
+      pixel-centered positions. When downsampling, the filters are
+      stretched by the downscaling factor, so that they antialias
+      (area averages the input pixels covered by each output pixel).
 ]]
 function SpatialReSamplingEx:__init(...)
    parent.__init(self)
@@ -13,7 +18,7 @@ function SpatialReSamplingEx:__init(...)
       {arg='rheight', type='number', help='ratio: oheight/iheight'},
       {arg='owidth', type='number', help='output width'},
       {arg='oheight', type='number', help='output height'},
-      {arg='mode', type='string', help='Mode : simple | average (only for downsampling) | bilinear', default = 'simple'},
+      {arg='mode', type='string', help='Mode : simple | average (only for downsampling) | bilinear | bicubic | lanczos | area', default = 'simple'},
       {arg='yDim', type='number', help='image y dimension', default=2},
       {arg='xDim', type='number', help='image x dimension', default=3}
    )
@@ -25,8 +30,11 @@ function SpatialReSamplingEx:__init(...)
    if self.mode == 'simple' then self.mode_c = 0 end
    if self.mode == 'average' then self.mode_c = 1 end
    if self.mode == 'bilinear' then self.mode_c = 2 end
+   if self.mode == 'bicubic' then self.mode_c = 3 end
+   if self.mode == 'lanczos' then self.mode_c = 4 end
+   if self.mode == 'area' then self.mode_c = 5 end
    if not self.mode_c then
-      error('SpatialReSampling: mode must be simple | average | bilinear')
+      error('SpatialReSampling: mode must be simple | average | bilinear | bicubic | lanczos | area')
    end
 end
 
@@ -40,7 +48,7 @@ function SpatialReSamplingEx:updateOutput(input)
    self.iwidth = input:size(self.xDim)
    self.oheightCurrent = self.oheight or round(self.rheight*self.iheight)
    self.owidthCurrent = self.owidth or round(self.rwidth*self.iwidth)
-   if not ((self.oheightCurrent>=self.iheight) == (self.owidthCurrent>=self.iwidth)) then
+   if self.mode_c < 3 and not ((self.oheightCurrent>=self.iheight) == (self.owidthCurrent>=self.iwidth)) then
       error('SpatialReSamplingEx: Cannot upsample one dimension while downsampling the other')
    end
    
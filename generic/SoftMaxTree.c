@@ -2,112 +2,758 @@
 #define TH_GENERIC_FILE "generic/SoftMaxTree.c"
 #else
 
+#ifndef NN_SOFTMAXTREE_STEP
+#define NN_SOFTMAXTREE_STEP
+/* columns of the flat path table (see SoftMaxTree:buildIndex()) */
+enum {
+  NN_PATH_PARENTID,
+  NN_PATH_PARENTIDX,
+  NN_PATH_CHILDIDX,
+  NN_PATH_NCHILDREN,
+  NN_PATH_OFFSET,
+  NN_PATH_SIZE
+};
+
+/* min number of children per chunk of a parent in accGradParameters */
+#define NN_SOFTMAXTREE_MINCHUNK 16
+
+/* Returns the first step of the path from childId up to the root, and
+ * stores its number of steps in nStep (< 1 if childId has no path). */
+static int* nn_SoftMaxTree_path(THIntTensor *pathTable, THIntTensor *childPath, long childId, long *nStep)
+{
+  int *child;
+  if (childId < 0 || childId >= childPath->size[0])
+  {
+    *nStep = -1;
+    return NULL;
+  }
+  child = THIntTensor_data(childPath) + 2*childId;
+  *nStep = child[1];
+  return THIntTensor_data(pathTable) + NN_PATH_SIZE*(child[0] - 1);
+}
+
+/* Computes where the path of each row of a batch starts in the path 
+ * buffer, i.e. the prefix sum of the sizes of the paths of the rows. 
+ * offsets gets batchSize+1 entries, the last one being the size of 
+ * the buffer. Returns -1 if a target has no path to the root. */
+static long nn_SoftMaxTree_offsets(THIntTensor *target, THIntTensor *pathTable, THIntTensor *childPath,
+                                   THLongTensor *offsets)
+{
+  long i, *offsets_data;
+  THLongTensor_resize1d(offsets, target->size[0]+1);
+  offsets_data = THLongTensor_data(offsets);
+  offsets_data[0] = 0;
+  for(i = 0; i < target->size[0]; i++)
+  {
+    long nStep;
+    int *path = nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+
+    if (nStep < 1)
+      return -1;
+
+    /* the last step (the root) ends the path */
+    path += NN_PATH_SIZE*(nStep-1);
+    offsets_data[i+1] = offsets_data[i] + path[NN_PATH_OFFSET] + path[NN_PATH_NCHILDREN];
+  }
+  return offsets_data[target->size[0]];
+}
+
+/* one (sample, ancestor) pair visited by a batch */
+typedef struct {
+  long parentId;
+  long parentIdx;
+  long nChildren;
+  long childIdx;
+  long row;
+  long offset;
+} nn_SoftMaxTreeStep;
+
+static int nn_SoftMaxTreeStep_compare(const void *a, const void *b)
+{
+  const nn_SoftMaxTreeStep *sa = (const nn_SoftMaxTreeStep*)a;
+  const nn_SoftMaxTreeStep *sb = (const nn_SoftMaxTreeStep*)b;
+  if (sa->parentId != sb->parentId)
+    return (sa->parentId < sb->parentId) ? -1 : 1;
+  return (sa->row < sb->row) ? -1 : (sa->row > sb->row);
+}
+
+/* Lists the (sample, parent) pairs visited by the targets of a batch, 
+ * sorted by parent. Returns the number of pairs, or -1 if a target 
+ * has no path to the root. */
+static long nn_SoftMaxTree_listSteps(THIntTensor *target, THIntTensor *pathTable, THIntTensor *childPath,
+                                     long *offsets, nn_SoftMaxTreeStep *steps)
+{
+  long i, k, nStep = 0;
+  for(i = 0; i < target->size[0]; i++)
+  {
+    long nPath;
+    int *path = nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nPath);
+
+    if (nPath < 1)
+      return -1;
+
+    for(k = 0; k < nPath; k++, path += NN_PATH_SIZE, nStep++)
+    {
+      steps[nStep].parentId = path[NN_PATH_PARENTID] - 1;
+      steps[nStep].parentIdx = path[NN_PATH_PARENTIDX] - 1;
+      steps[nStep].nChildren = path[NN_PATH_NCHILDREN];
+      steps[nStep].childIdx = path[NN_PATH_CHILDIDX] - 1;
+      steps[nStep].row = i;
+      steps[nStep].offset = offsets[i] + path[NN_PATH_OFFSET];
+    }
+  }
+  qsort(steps, nStep, sizeof(nn_SoftMaxTreeStep), nn_SoftMaxTreeStep_compare);
+  return nStep;
+}
+
+/* a node reached by the search of topk, scored with its log-likelihood */
+typedef struct {
+  double score;
+  long nodeId;
+} nn_SoftMaxTreeNode;
+
+/* binary heap of nodes : max-heap if sign is 1, min-heap if it is -1 */
+static void nn_SoftMaxTree_heapPush(nn_SoftMaxTreeNode *heap, long *size, nn_SoftMaxTreeNode node, int sign)
+{
+  long i = (*size)++;
+  while (i > 0)
+  {
+    long parent = (i-1)/2;
+    if (sign*heap[parent].score >= sign*node.score)
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = node;
+}
+
+static nn_SoftMaxTreeNode nn_SoftMaxTree_heapPop(nn_SoftMaxTreeNode *heap, long *size, int sign)
+{
+  nn_SoftMaxTreeNode top = heap[0];
+  nn_SoftMaxTreeNode last = heap[--(*size)];
+  long i = 0;
+  while (2*i+1 < *size)
+  {
+    long child = 2*i+1;
+    if (child+1 < *size && sign*heap[child+1].score > sign*heap[child].score)
+      child++;
+    if (sign*last.score >= sign*heap[child].score)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/* IEEE 754 binary16 conversions for the half-precision weights */
+typedef union {
+  unsigned int i;
+  float f;
+} nn_SoftMaxTreeFloatBits;
+
+static float nn_SoftMaxTree_half2float(unsigned short h)
+{
+  nn_SoftMaxTreeFloatBits u;
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+  unsigned int exponent = (h >> 10) & 0x1f;
+  unsigned int mantissa = h & 0x3ff;
+
+  if (exponent == 0x1f) /* inf or nan */
+    u.i = sign | 0x7f800000 | (mantissa << 13);
+  else if (exponent != 0) /* normal */
+    u.i = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  else /* zero or subnormal */
+  {
+    u.f = mantissa * (1.0f/16777216.0f);
+    u.i |= sign;
+  }
+  return u.f;
+}
+
+static unsigned short nn_SoftMaxTree_float2half(float f)
+{
+  nn_SoftMaxTreeFloatBits u;
+  unsigned int sign, exponent, mantissa, h;
+  u.f = f;
+  sign = (u.i >> 16) & 0x8000;
+  exponent = (u.i >> 23) & 0xff;
+  mantissa = u.i & 0x7fffff;
+
+  if (exponent == 0xff) /* inf or nan */
+    return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  if (exponent > 142) /* overflow */
+    return (unsigned short)(sign | 0x7c00);
+  if (exponent < 113) /* subnormal or zero */
+  {
+    unsigned int shift = 126 - exponent;
+    if (exponent < 103)
+      return (unsigned short)sign;
+    mantissa |= 0x800000;
+    h = (mantissa + (1u << (shift-1))) >> shift;
+    return (unsigned short)(sign | h);
+  }
+  /* round to nearest, the carry may overflow into the exponent */
+  h = ((exponent - 112) << 10) + (mantissa >> 13);
+  if (mantissa & 0x1000)
+    h++;
+  return (unsigned short)(sign | h);
+}
+
+/* Builds the index of the tree from a nEdge x 2 IntTensor of
+ * {childId, parentId}, and stores it in the fields of the module
+ * (see SoftMaxTree:buildIndex()). Parents are indexed in order of first
+ * appearance, and the children of each parent in order of appearance,
+ * which is also the order of the rows of weight. */
+static int nn_SoftMaxTree_buildIndex(lua_State *L)
+{
+  THIntTensor *edges = (THIntTensor*)luaT_checkudata(L, 2, "torch.IntTensor");
+  long rootId = (long)luaT_getfieldcheckint(L, 1, "rootId");
+  THIntTensor *parentChildren, *childParent, *childIds, *parentIds, *pathTable, *childPath;
+  int *edges_data, *pc, *cp, *ids, *path_data, *child_data;
+  long *cursor, *depths;
+  long nEdge, nParent = 0, nStep = 0, e, start;
+  long minNodeId = LONG_MAX, maxNodeId = 0, maxParentId = 0, maxChildId = 0;
+  long maxFamily = 0, maxFamilyPath = 0, maxDept = 0;
+  const char *error = NULL;
+
+  luaL_argcheck(L, edges->nDimension == 2 && edges->size[1] == 2 && edges->size[0] > 0, 2, \
+    "nEdge x 2 IntTensor of {childId, parentId} expected");
+
+  edges = THIntTensor_newContiguous(edges);
+  edges_data = THIntTensor_data(edges);
+  nEdge = edges->size[0];
+
+  for(e = 0; e < nEdge; e++)
+  {
+    long childId = edges_data[2*e], parentId = edges_data[2*e+1];
+    minNodeId = THMin(minNodeId, THMin(childId, parentId));
+    maxNodeId = THMax(maxNodeId, THMax(childId, parentId));
+    maxChildId = THMax(maxChildId, childId);
+    maxParentId = THMax(maxParentId, parentId);
+  }
+  if (minNodeId < 1)
+  {
+    THIntTensor_free(edges);
+    luaL_error(L, "nodeIds must must be positive: %d", (int)minNodeId);
+  }
+
+  childParent = THIntTensor_newWithSize2d(maxChildId, 2);
+  parentChildren = THIntTensor_newWithSize2d(maxParentId, 2);
+  childIds = THIntTensor_newWithSize1d(nEdge);
+  parentIds = THIntTensor_new();
+  pathTable = THIntTensor_new();
+  childPath = THIntTensor_newWithSize2d(maxChildId, 2);
+  THIntTensor_fill(childParent, -1);
+  THIntTensor_fill(parentChildren, -1);
+  THIntTensor_fill(childPath, -1);
+  cp = THIntTensor_data(childParent);
+  pc = THIntTensor_data(parentChildren);
+  ids = THIntTensor_data(childIds);
+  cursor = (long*)THAlloc(sizeof(long)*maxParentId);
+  depths = (long*)THAlloc(sizeof(long)*nEdge);
+
+  /* count the children of each parent, in order of first appearance */
+  THIntTensor_resize1d(parentIds, nEdge);
+  for(e = 0; e < nEdge; e++)
+  {
+    long childId = edges_data[2*e], parentId = edges_data[2*e+1];
+    if (cp[2*(childId-1)] != -1)
+    {
+      error = "Only works with a tree (one parent per child)";
+      goto cleanup;
+    }
+    cp[2*(childId-1)] = parentId;
+    if (pc[2*(parentId-1)+1] == -1)
+    {
+      THIntTensor_data(parentIds)[nParent++] = parentId;
+      pc[2*(parentId-1)+1] = 0;
+    }
+    pc[2*(parentId-1)+1]++;
+  }
+  THIntTensor_resize1d(parentIds, nParent);
+
+  /* the children of a parent are contiguous (1-based start) */
+  start = 1;
+  for(e = 0; e < nParent; e++)
+  {
+    long parentId = THIntTensor_data(parentIds)[e];
+    pc[2*(parentId-1)] = start;
+    cursor[parentId-1] = start-1;
+    start += pc[2*(parentId-1)+1];
+    maxFamily = THMax(maxFamily, pc[2*(parentId-1)+1]);
+  }
+
+  for(e = 0; e < nEdge; e++)
+  {
+    long childId = edges_data[2*e], parentId = edges_data[2*e+1];
+    long idx = cursor[parentId-1]++;
+    ids[idx] = childId;
+    cp[2*(childId-1)+1] = idx - pc[2*(parentId-1)] + 2;
+  }
+
+  /* number of steps from each child up to the root (0 if not rooted) */
+  for(e = 0; e < nEdge; e++)
+  {
+    long nodeId = ids[e], depth = 0, familyPath = 0;
+    while (1)
+    {
+      long parentId = cp[2*(nodeId-1)];
+      depth++;
+      familyPath += pc[2*(parentId-1)+1];
+      if (parentId == rootId)
+        break;
+      if (parentId > maxChildId || cp[2*(parentId-1)] == -1)
+      {
+        depth = 0;
+        break;
+      }
+      if (depth > nParent)
+      {
+        error = "Hierarchy contains a cycle";
+        goto cleanup;
+      }
+      nodeId = parentId;
+    }
+    depths[e] = depth;
+    nStep += depth;
+    if (depth > 0)
+    {
+      maxDept = THMax(maxDept, depth);
+      maxFamilyPath = THMax(maxFamilyPath, familyPath);
+    }
+  }
+
+  /* flat table of the paths (see SoftMaxTree:buildIndex()) */
+  THIntTensor_resize2d(pathTable, THMax(nStep, 1), NN_PATH_SIZE);
+  THIntTensor_zero(pathTable);
+  path_data = THIntTensor_data(pathTable);
+  child_data = THIntTensor_data(childPath);
+  start = 0;
+  for(e = 0; e < nEdge; e++)
+  {
+    long nodeId = ids[e], offset = 0, k;
+    if (depths[e] == 0)
+      continue;
+    child_data[2*(nodeId-1)] = start+1;
+    child_data[2*(nodeId-1)+1] = depths[e];
+    for(k = 0; k < depths[e]; k++, start++)
+    {
+      long parentId = cp[2*(nodeId-1)];
+      int *step = path_data + NN_PATH_SIZE*start;
+      step[NN_PATH_PARENTID] = parentId;
+      step[NN_PATH_PARENTIDX] = pc[2*(parentId-1)];
+      step[NN_PATH_CHILDIDX] = cp[2*(nodeId-1)+1];
+      step[NN_PATH_NCHILDREN] = pc[2*(parentId-1)+1];
+      step[NN_PATH_OFFSET] = offset;
+      offset += pc[2*(parentId-1)+1];
+      nodeId = parentId;
+    }
+  }
+
+cleanup:
+  THIntTensor_free(edges);
+  THFree(cursor);
+  THFree(depths);
+  if (error)
+  {
+    THIntTensor_free(childParent);
+    THIntTensor_free(parentChildren);
+    THIntTensor_free(childIds);
+    THIntTensor_free(parentIds);
+    THIntTensor_free(pathTable);
+    THIntTensor_free(childPath);
+    luaL_error(L, "%s", error);
+  }
+
+  luaT_pushudata(L, childParent, "torch.IntTensor");
+  lua_setfield(L, 1, "childParent");
+  luaT_pushudata(L, parentChildren, "torch.IntTensor");
+  lua_setfield(L, 1, "parentChildren");
+  luaT_pushudata(L, childIds, "torch.IntTensor");
+  lua_setfield(L, 1, "childIds");
+  luaT_pushudata(L, parentIds, "torch.IntTensor");
+  lua_setfield(L, 1, "parentIds");
+  luaT_pushudata(L, pathTable, "torch.IntTensor");
+  lua_setfield(L, 1, "pathTable");
+  luaT_pushudata(L, childPath, "torch.IntTensor");
+  lua_setfield(L, 1, "childPath");
+
+  lua_pushnumber(L, nEdge);
+  lua_setfield(L, 1, "nChildNode");
+  lua_pushnumber(L, nParent);
+  lua_setfield(L, 1, "nParentNode");
+  lua_pushnumber(L, minNodeId);
+  lua_setfield(L, 1, "minNodeId");
+  lua_pushnumber(L, maxNodeId);
+  lua_setfield(L, 1, "maxNodeId");
+  lua_pushnumber(L, maxParentId);
+  lua_setfield(L, 1, "maxParentId");
+  lua_pushnumber(L, maxChildId);
+  lua_setfield(L, 1, "maxChildId");
+  lua_pushnumber(L, maxFamily);
+  lua_setfield(L, 1, "maxFamily");
+  lua_pushnumber(L, maxFamilyPath);
+  lua_setfield(L, 1, "maxFamilyPath");
+  lua_pushnumber(L, maxDept);
+  lua_setfield(L, 1, "maxDept");
+  return 0;
+}
+#endif
+
+/* Forward of a row of the input (nodeInput) through the path of its
+ * target : the LogSoftMax of each step is written to logsoft_data and
+ * the sum of the log-likelihoods along the path is returned. The other
+ * tensors are headers, linearOutput holds at least maxFamily elements. */
+static accreal nn_(SoftMaxTree_pathOutput)(THTensor *nodeInput, int *path, long nStep,
+                                           THTensor *weight, THTensor *bias, real *logsoft_data,
+                                           THTensor *nodeWeight, THTensor *nodeBias,
+                                           THTensor *nodeOutput, THTensor *linearOutput)
+{
+  accreal narrowsum = 0;
+  long k, d;
+
+  for(k = 0; k < nStep; k++, path += NN_PATH_SIZE)
+  {
+    long parentIdx = path[NN_PATH_PARENTIDX] - 1;
+    long childIdx = path[NN_PATH_CHILDIDX] - 1;
+    long nChildren = path[NN_PATH_NCHILDREN];
+    accreal logsum = 0;
+    real maxInput = -THInf;
+    real *input_data, *output_data;
+
+    /* Linear */
+    THTensor_(narrow)(nodeWeight, weight, 0, parentIdx, nChildren);
+    THTensor_(narrow)(nodeBias, bias, 0, parentIdx, nChildren);
+    THTensor_(narrow)(nodeOutput, linearOutput, 0, 0, nChildren);
+
+    THTensor_(addmv)(nodeOutput, 1, nodeBias, 1, nodeWeight, nodeInput);
+
+    /* LogSoftMax */
+    input_data = THTensor_(data)(nodeOutput);
+    output_data = logsoft_data + path[NN_PATH_OFFSET];
+
+    for(d = 0; d < nChildren; d++)
+      maxInput = THMax(maxInput, input_data[d]);
+
+    for(d = 0; d < nChildren; d++)
+      logsum += THExpMinusApprox(maxInput-input_data[d]);
+    logsum = maxInput + log(logsum);
+
+    for(d = 0; d < nChildren; d++)
+      output_data[d] = input_data[d] - logsum;
+
+    /* Narrow + CAddTable (without log, would have been CMulTable) */
+    narrowsum += output_data[childIdx];
+  }
+  return narrowsum;
+}
+
 static int nn_(SoftMaxTree_updateOutput)(lua_State *L)
 {
   THTensor *input = luaT_checkudata(L, 2, torch_Tensor);  
   THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 3, "torch.IntTensor");  
   int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
-  long rootId = (long)(luaT_getfieldcheckint(L, 1, "rootId") - 1);
-  long maxFamilyPath = (long)luaT_getfieldcheckint(L, 1, "maxFamilyPath");
+  long maxFamily = (long)luaT_getfieldcheckint(L, 1, "maxFamily");
   
-  THIntTensor *childParent = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childParent", "torch.IntTensor");
-  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
   
-  THTensor *linearOutput = luaT_getfieldcheckudata(L, 1, "_nodeBuffer", torch_Tensor);
   THTensor *logsoftOutput = luaT_getfieldcheckudata(L, 1, "_multiBuffer", torch_Tensor);
+  THLongTensor *offsets = (THLongTensor*)luaT_getfieldcheckudata(L, 1, "_multiOffsets", "torch.LongTensor");
   
   THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
   THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
   THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
   
-  THIntTensor *node;
-  THTensor *nodeWeight, *nodeBias, *nodeOutput, *nodeInput, *nodeInter;
-  real *input_data, *output_data;
+  long *offsets_data;
+  long i, bufferSize;
+  
+  luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
+  luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
+  luaL_argcheck(L, target->nDimension == 1 && target->size[0] == input->size[0], 3, \
+    "1D target with one element per row of input expected");
 
-  long i, d;
+  /* the buffer holds exactly the paths of the batch */
+  bufferSize = nn_SoftMaxTree_offsets(target, pathTable, childPath, offsets);
+  luaL_argcheck(L, bufferSize >= 0, 3, "Non-root node has no parent in tree.");
+  THTensor_(resize1d)(logsoftOutput, bufferSize);
+  offsets_data = THLongTensor_data(offsets);
+
+  THTensor_(resize1d)(output, input->size[0]);
+  
+  /* each sample only writes to its own paths of the buffer */
+#pragma omp parallel private(i)
+  {
+    THTensor *nodeWeight = THTensor_(new)();
+    THTensor *nodeBias = THTensor_(new)();
+    THTensor *nodeOutput = THTensor_(new)();
+    THTensor *nodeInput = THTensor_(new)();
+    THTensor *linearOutput = THTensor_(newWithSize1d)(maxFamily);
+
+#pragma omp for
+    for(i = 0; i < input->size[0]; i++)
+    {
+      long nStep;
+      int *path = nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+  
+      THTensor_(select)(nodeInput, input, 0, i);
+      THTensor_(set1d)(output, i, nn_(SoftMaxTree_pathOutput)(nodeInput, path, nStep, weight, bias,
+        THTensor_(data)(logsoftOutput) + offsets_data[i], nodeWeight, nodeBias, nodeOutput, linearOutput));
+    }
+      
+    THTensor_(free)(nodeWeight);
+    THTensor_(free)(nodeBias);
+    THTensor_(free)(nodeOutput);
+    THTensor_(free)(nodeInput);
+    THTensor_(free)(linearOutput);
+  }
+  
+  return 1;
+}
+
+/* the fields of a SoftMaxTree used by forestOutput */
+typedef struct {
+  THTensor *weight, *bias, *logsoftOutput, *output;
+  THIntTensor *pathTable, *childPath;
+  long *offsets_data;
+} nn_(SoftMaxTreeExpert);
+
+/* Forward of the SoftMaxTree experts of a SoftMaxForest (a table), 
+ * in parallel over all the (expert, row) pairs. Each expert writes to 
+ * its own buffers. When a gate (batchSize x nExpert) is given, the 
+ * pairs whose gate is below threshold are skipped (except for the 
+ * largest gate of each row), and their output is set to 0. The caller 
+ * must zero the gates of the skipped pairs before mixing the outputs, 
+ * as 0 would otherwise count as a log-likelihood. */
+static int nn_(SoftMaxTree_forestOutput)(lua_State *L)
+{
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
+  THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 3, "torch.IntTensor");
+  THTensor *gate = luaT_toudata(L, 4, torch_Tensor);
+  real threshold = luaL_optnumber(L, 5, 0);
+  nn_(SoftMaxTreeExpert) *experts;
+  long nExpert, batchSize, maxFamily = 0, e, n;
+  int top = lua_gettop(L);
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
+
+  nExpert = 0;
+  lua_rawgeti(L, 1, 1);
+  while (!lua_isnil(L, -1))
+  {
+    nExpert++;
+    lua_pop(L, 1);
+    lua_rawgeti(L, 1, nExpert+1);
+  }
+  lua_pop(L, 1);
+  luaL_argcheck(L, nExpert > 0, 1, "table of SoftMaxTrees expected");
+
+  batchSize = input->size[0];
+  luaL_argcheck(L, target->nDimension == 1 && target->size[0] == batchSize, 3, \
+    "1D target with one element per row of input expected");
+  if (gate)
+    luaL_argcheck(L, gate->nDimension == 2 && gate->size[0] == batchSize && gate->size[1] == nExpert, 4, \
+      "batchSize x nExpert gate expected");
+
+  /* fetch the fields and prepare the buffers of the experts */
+  experts = (nn_(SoftMaxTreeExpert)*)THAlloc(sizeof(nn_(SoftMaxTreeExpert))*nExpert);
+  for(e = 0; e < nExpert; e++)
+  {
+    nn_(SoftMaxTreeExpert) *expert = experts + e;
+    THLongTensor *offsets;
+    long bufferSize;
+    int ud;
+
+    lua_rawgeti(L, 1, e+1);
+    ud = lua_gettop(L);
+    if (input->size[1] != luaT_getfieldcheckint(L, ud, "inputSize"))
+    {
+      THFree(experts);
+      luaL_argerror(L, 2, "invalid input size");
+    }
+    maxFamily = THMax(maxFamily, luaT_getfieldcheckint(L, ud, "maxFamily"));
+    expert->pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, ud, "pathTable", "torch.IntTensor");
+    expert->childPath = (THIntTensor*)luaT_getfieldcheckudata(L, ud, "childPath", "torch.IntTensor");
+    expert->logsoftOutput = luaT_getfieldcheckudata(L, ud, "_multiBuffer", torch_Tensor);
+    expert->weight = luaT_getfieldcheckudata(L, ud, "weight", torch_Tensor);
+    expert->bias = luaT_getfieldcheckudata(L, ud, "bias", torch_Tensor);
+    expert->output = luaT_getfieldcheckudata(L, ud, "output", torch_Tensor);
+    offsets = (THLongTensor*)luaT_getfieldcheckudata(L, ud, "_multiOffsets", "torch.LongTensor");
+
+    bufferSize = nn_SoftMaxTree_offsets(target, expert->pathTable, expert->childPath, offsets);
+    if (bufferSize < 0)
+    {
+      THFree(experts);
+      luaL_argerror(L, 3, "Non-root node has no parent in tree.");
+    }
+    THTensor_(resize1d)(expert->logsoftOutput, bufferSize);
+    THTensor_(resize1d)(expert->output, batchSize);
+    expert->offsets_data = THLongTensor_data(offsets);
+
+    /* the fields are still referenced by the experts */
+    lua_settop(L, top);
+  }
+
+#pragma omp parallel private(n)
+  {
+    THTensor *nodeWeight = THTensor_(new)();
+    THTensor *nodeBias = THTensor_(new)();
+    THTensor *nodeOutput = THTensor_(new)();
+    THTensor *nodeInput = THTensor_(new)();
+    THTensor *linearOutput = THTensor_(newWithSize1d)(maxFamily);
+
+#pragma omp for schedule(dynamic, 16)
+    for(n = 0; n < nExpert*batchSize; n++)
+    {
+      nn_(SoftMaxTreeExpert) *expert = experts + n/batchSize;
+      long i = n % batchSize;
+      long nStep, j;
+      int *path;
+
+      if (gate && THTensor_(get2d)(gate, i, n/batchSize) < threshold)
+      {
+        /* skipped, unless it is the best expert of the row */
+        real g = THTensor_(get2d)(gate, i, n/batchSize);
+        for(j = 0; j < nExpert && THTensor_(get2d)(gate, i, j) <= g; j++);
+        if (j < nExpert)
+        {
+          THTensor_(set1d)(expert->output, i, 0);
+          continue;
+        }
+      }
+
+      path = nn_SoftMaxTree_path(expert->pathTable, expert->childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+      THTensor_(select)(nodeInput, input, 0, i);
+      THTensor_(set1d)(expert->output, i, nn_(SoftMaxTree_pathOutput)(nodeInput, path, nStep, expert->weight, expert->bias,
+        THTensor_(data)(expert->logsoftOutput) + expert->offsets_data[i], nodeWeight, nodeBias, nodeOutput, linearOutput));
+    }
+
+    THTensor_(free)(nodeWeight);
+    THTensor_(free)(nodeBias);
+    THTensor_(free)(nodeOutput);
+    THTensor_(free)(nodeInput);
+    THTensor_(free)(linearOutput);
+  }
+
+  THFree(experts);
+  return 0;
+}
+
+/* Same as updateOutput, but the batch rows are first bucketed by the 
+ * parent nodes on their paths, such that each touched parent is 
+ * evaluated with a single addmm over all the rows that visit it. */
+static int nn_(SoftMaxTree_updateOutputGrouped)(lua_State *L)
+{
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);  
+  THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 3, "torch.IntTensor");  
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+  long maxDept = (long)luaT_getfieldcheckint(L, 1, "maxDept");
+  
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
+  
+  THTensor *groupInput = luaT_getfieldcheckudata(L, 1, "_groupInput", torch_Tensor);
+  THTensor *groupOutput = luaT_getfieldcheckudata(L, 1, "_groupOutput", torch_Tensor);
+  THTensor *logsoftOutput = luaT_getfieldcheckudata(L, 1, "_multiBuffer", torch_Tensor);
+  THLongTensor *offsets = (THLongTensor*)luaT_getfieldcheckudata(L, 1, "_multiOffsets", "torch.LongTensor");
+  
+  THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
+  THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+  
+  THTensor *nodeWeight, *weightTranspose;
+  nn_SoftMaxTreeStep *steps;
+  real *input_data, *bias_data, *logsoft_data, *output_data;
+  long batchSize, bufferSize, nStep, s, start, i, d;
   
   luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
   luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
+  luaL_argcheck(L, target->nDimension == 1 && target->size[0] == input->size[0], 3, \
+    "1D target with one element per row of input expected");
+  /* the biases of a parent are copied as contiguous rows */
+  luaL_argcheck(L, THTensor_(isContiguous)(bias), 1, "contiguous bias expected");
 
-  node = THIntTensor_new();
+  /* the buffer holds exactly the paths of the batch */
+  bufferSize = nn_SoftMaxTree_offsets(target, pathTable, childPath, offsets);
+  luaL_argcheck(L, bufferSize >= 0, 3, "Non-root node has no parent in tree.");
+  THTensor_(resize1d)(logsoftOutput, bufferSize);
+  
+  batchSize = input->size[0];
+  input = THTensor_(newContiguous)(input);
+  
+  THTensor_(resize1d)(output, batchSize);
+  THTensor_(zero)(output);
+  
+  steps = (nn_SoftMaxTreeStep*)THAlloc(sizeof(nn_SoftMaxTreeStep)*batchSize*maxDept);
+  
+  /* list the (sample, parent) pairs of the batch, bucketed by parent */
+  nStep = nn_SoftMaxTree_listSteps(target, pathTable, childPath, THLongTensor_data(offsets), steps);
+  
   nodeWeight = THTensor_(new)();
-  nodeBias = THTensor_(new)();
-  nodeOutput = THTensor_(new)();
-  nodeInput = THTensor_(new)();
-  nodeInter = THTensor_(new)();
+  weightTranspose = THTensor_(new)();
   
-  THTensor_(resize1d)(output, input->size[0]);
+  input_data = THTensor_(data)(input);
+  bias_data = THTensor_(data)(bias);
+  logsoft_data = THTensor_(data)(logsoftOutput);
+  output_data = THTensor_(data)(output);
   
-  for(i = 0; i < input->size[0]; i++)
+  for(start = 0; start < nStep; start = s)
   {
-    long n = 0;
-    long childId = (long)(THIntTensor_get1d(target, i)) - 1;
-    accreal narrowsum = 0;
-    THTensor_(select)(nodeInput, input, 0, i);
-    while(1)
+    long parentId = steps[start].parentId;
+    long parentIdx = steps[start].parentIdx;
+    long nChildren = steps[start].nChildren;
+    long nRow;
+    real *group_data;
+    
+    for(s = start; s < nStep && steps[s].parentId == parentId; s++);
+    nRow = s - start;
+    
+    /* gather the rows that visit this parent */
+    THTensor_(resize2d)(groupInput, nRow, inputSize);
+    THTensor_(resize2d)(groupOutput, nRow, nChildren);
+    for(i = 0; i < nRow; i++)
     {
-      long parentId, parentIdx, childIdx, nChildren;
-      /* get next Node in Tree */
-      THIntTensor_select(node, childParent, 0, childId);
-      parentId = (long)(THIntTensor_get1d(node, 0)) - 1;
-      childIdx = (long)(THIntTensor_get1d(node, 1)) - 1;
-      
-      luaL_argcheck(L, parentId != -2, 2, "Non-root node has no parent in tree.");
-      
-      THIntTensor_select(node, parentChildren, 0, parentId);
-      parentIdx = (long)(THIntTensor_get1d(node, 0)) - 1;
-      nChildren = (long)(THIntTensor_get1d(node, 1));
-  
-      /* Linear */
-      THTensor_(narrow)(nodeWeight, weight, 0, parentIdx, nChildren);
-      THTensor_(narrow)(nodeBias, bias, 0, parentIdx, nChildren);
-      THTensor_(narrow)(nodeOutput, linearOutput, 0, 0, nChildren);
-      
-      THTensor_(addmv)(nodeOutput, 1, nodeBias, 1, nodeWeight, nodeInput);
-      
-      /* LogSoftMax */
-      THTensor_(set)(nodeInter, nodeOutput);
-      THTensor_(narrow)(nodeOutput, logsoftOutput, 0, maxFamilyPath*i + n, nChildren);
-      
-      input_data = THTensor_(data)(nodeInter);
-      output_data = THTensor_(data)(nodeOutput);
-      
+      memcpy(THTensor_(data)(groupInput) + i*inputSize, 
+             input_data + steps[start+i].row*inputSize, sizeof(real)*inputSize);
+      memcpy(THTensor_(data)(groupOutput) + i*nChildren, 
+             bias_data + parentIdx, sizeof(real)*nChildren);
+    }
+    
+    /* Linear */
+    THTensor_(narrow)(nodeWeight, weight, 0, parentIdx, nChildren);
+    THTensor_(transpose)(weightTranspose, nodeWeight, 0, 1);
+    THTensor_(addmm)(groupOutput, 1, groupOutput, 1, groupInput, weightTranspose);
+    
+    /* LogSoftMax, scattered back into the rows' buffers */
+    group_data = THTensor_(data)(groupOutput);
+    for(i = 0; i < nRow; i++, group_data += nChildren)
+    {
+      nn_SoftMaxTreeStep *step = steps + start + i;
+      real *row_data = logsoft_data + step->offset;
       accreal logsum = 0;
       real maxInput = -THInf;
       
       for(d = 0; d < nChildren; d++)
-        maxInput = THMax(maxInput, input_data[d]);
+        maxInput = THMax(maxInput, group_data[d]);
 
       for(d = 0; d < nChildren; d++)
-        logsum += THExpMinusApprox(maxInput-input_data[d]);
+        logsum += THExpMinusApprox(maxInput-group_data[d]);
       logsum = maxInput + log(logsum);
 
       for(d = 0; d < nChildren; d++)
-        output_data[d] = input_data[d] - logsum;
-        
-      /* Narrow */
-      THTensor_(set)(nodeInter, nodeOutput);
-      THTensor_(narrow)(nodeOutput, nodeInter, 0, childIdx, 1); 
+        row_data[d] = group_data[d] - logsum;
       
-      /* CAddTable (without log, would have been CMulTable) */
-      narrowsum += THTensor_(get1d)(nodeOutput, 0);
-      n += nChildren;
-      /* Break when root is reached */
-      if (parentId == rootId) 
-      {
-        break;
-      }
-      childId = parentId;
+      /* Narrow + CAddTable */
+      output_data[step->row] += row_data[step->childIdx];
     }
-    THTensor_(set1d)(output, i, narrowsum);  
   }
   
-  THIntTensor_free(node);
   THTensor_(free)(nodeWeight);
-  THTensor_(free)(nodeBias);
-  THTensor_(free)(nodeOutput);
-  THTensor_(free)(nodeInput);
-  THTensor_(free)(nodeInter);
+  THTensor_(free)(weightTranspose);
+  THTensor_(free)(input);
+  THFree(steps);
   return 1;
 }
 
@@ -117,93 +763,91 @@ static int nn_(SoftMaxTree_updateGradInput)(lua_State *L)
   THTensor *gradOutput = luaT_checkudata(L, 3, torch_Tensor);  
   THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 4, "torch.IntTensor");  
   int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
-  long rootId = (long)(luaT_getfieldcheckint(L, 1, "rootId") - 1);
-  long maxFamilyPath = (long)luaT_getfieldcheckint(L, 1, "maxFamilyPath");
   
-  THIntTensor *childParent = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childParent", "torch.IntTensor");
-  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
   
   THTensor *logsoftOutput = luaT_getfieldcheckudata(L, 1, "_multiBuffer", torch_Tensor);
+  THLongTensor *offsets = (THLongTensor*)luaT_getfieldcheckudata(L, 1, "_multiOffsets", "torch.LongTensor");
   
   THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
   THTensor *gradInput = luaT_getfieldcheckudata(L, 1, "_gradInput", torch_Tensor);
   
-  THIntTensor *node;
-  THTensor *nodeWeight, *nodeOutput;
-  THTensor *nodeGradInput, *weightTranspose;
-  real *output_data;
-
-  long i, d;
+  THTensor *weightTranspose;
+  long *offsets_data;
+  long i;
   
   luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
   luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
   
-  luaL_argcheck(L, gradOutput->nDimension == 1, 2, "1D tensor expected");
+  luaL_argcheck(L, gradOutput->nDimension == 1 && gradOutput->size[0] == input->size[0], 3, \
+    "1D gradOutput with one element per row of input expected");
+  luaL_argcheck(L, target->nDimension == 1 && target->size[0] == input->size[0], 4, \
+    "1D target with one element per row of input expected");
+
+  luaL_argcheck(L, offsets->nDimension == 1 && offsets->size[0] == input->size[0]+1 \
+    && logsoftOutput->size[0] == THLongTensor_get1d(offsets, input->size[0]), 2, \
+    "Backward performed on different inputs than last forward");
+  offsets_data = THLongTensor_data(offsets);
+
+  /* check the targets before going parallel */
+  for(i = 0; i < input->size[0]; i++)
+  {
+    long nStep;
+    nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+    luaL_argcheck(L, nStep > 0, 4, "Non-root node has no parent in tree.");
+  }
 
-  node = THIntTensor_new();
-  nodeWeight = THTensor_(new)();
-  nodeOutput = THTensor_(new)();
-  nodeGradInput = THTensor_(new)();
   weightTranspose = THTensor_(new)();
   
   THTensor_(transpose)(weightTranspose, weight, 0, 1);
   THTensor_(resizeAs)(gradInput, input);
   THTensor_(zero)(gradInput);
   
-  for(i = 0; i < input->size[0]; i++)
+  /* each sample only writes to its own row of gradInput and of the buffer */
+#pragma omp parallel private(i)
   {
-    long n = 0;
-    long childId = (long)(THIntTensor_get1d(target, i)) - 1;
-    real grad = THTensor_(get1d)(gradOutput, i);
+    THTensor *nodeWeight = THTensor_(new)();
+    THTensor *nodeOutput = THTensor_(new)();
+    THTensor *nodeGradInput = THTensor_(new)();
     
-    THTensor_(select)(nodeGradInput, gradInput, 0, i);
-    
-    while(1)
+#pragma omp for
+    for(i = 0; i < input->size[0]; i++)
     {
-      long parentId, parentIdx, childIdx, nChildren;
-      /* get next Node in Tree */
-      THIntTensor_select(node, childParent, 0, childId);
-      parentId = (long)(THIntTensor_get1d(node, 0)) - 1;
-      childIdx = (long)(THIntTensor_get1d(node, 1)) - 1;
-      
-      luaL_argcheck(L, parentId != -2, 2, "Non-root node has no parent in tree.");
-      
-      THIntTensor_select(node, parentChildren, 0, parentId);
-      parentIdx = (long)(THIntTensor_get1d(node, 0)) - 1;
-      nChildren = (long)(THIntTensor_get1d(node, 1));
-      
-      luaL_argcheck(L, logsoftOutput->size[0] >= n+nChildren, 2, \
-        "Backward performed on different inputs than last forward");
+      long nStep, k, d;
+      int *path = nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+      real grad = THTensor_(get1d)(gradOutput, i);
+    
+      THTensor_(select)(nodeGradInput, gradInput, 0, i);
       
-      /* CAddTable + Narrow + LogSoftMax */
-      THTensor_(narrow)(nodeOutput, logsoftOutput, 0, maxFamilyPath*i + n, nChildren);
+      for(k = 0; k < nStep; k++, path += NN_PATH_SIZE)
+      {
+        long parentIdx = path[NN_PATH_PARENTIDX] - 1;
+        long childIdx = path[NN_PATH_CHILDIDX] - 1;
+        long nChildren = path[NN_PATH_NCHILDREN];
+        real *output_data;
       
-      output_data = THTensor_(data)(nodeOutput);
+        /* CAddTable + Narrow + LogSoftMax */
+        THTensor_(narrow)(nodeOutput, logsoftOutput, 0, offsets_data[i] + path[NN_PATH_OFFSET], nChildren);
 
-      for(d = 0; d < nChildren; d++)
-        output_data[d] = -exp(output_data[d])*grad;
-      output_data[childIdx] += grad;
+        output_data = THTensor_(data)(nodeOutput);
 
+        for(d = 0; d < nChildren; d++)
+          output_data[d] = -exp(output_data[d])*grad;
+        output_data[childIdx] += grad;
   
-      /* Linear */
-      THTensor_(narrow)(nodeWeight, weightTranspose, 1, parentIdx, nChildren);
-      
-      THTensor_(addmv)(nodeGradInput, 1, nodeGradInput, 1, nodeWeight, nodeOutput);
+        /* Linear */
+        THTensor_(narrow)(nodeWeight, weightTranspose, 1, parentIdx, nChildren);
       
-      n += nChildren;
-      /* Break when root is reached */
-      if (parentId == rootId) 
-      {
-        break;
+        THTensor_(addmv)(nodeGradInput, 1, nodeGradInput, 1, nodeWeight, nodeOutput);
       }
-      childId = parentId;
     }
+    
+    THTensor_(free)(nodeWeight);
+    THTensor_(free)(nodeOutput);
+    THTensor_(free)(nodeGradInput);
   }
   
-  THIntTensor_free(node);
-  THTensor_(free)(nodeWeight);
-  THTensor_(free)(nodeOutput);
-  THTensor_(free)(nodeGradInput);
   THTensor_(free)(weightTranspose);
   return 1;
 }
@@ -213,95 +857,783 @@ static int nn_(SoftMaxTree_accGradParameters)(lua_State *L)
   THTensor *input = luaT_checkudata(L, 2, torch_Tensor);  
   THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 4, "torch.IntTensor");  
   real scale = luaL_optnumber(L, 5, 1);
-  long rootId = (long)(luaT_getfieldcheckint(L, 1, "rootId") - 1);
-  long maxFamilyPath = (long)luaT_getfieldcheckint(L, 1, "maxFamilyPath");
+  long maxDept = (long)luaT_getfieldcheckint(L, 1, "maxDept");
   
   int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
-  THIntTensor *childParent = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childParent", "torch.IntTensor");
-  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
   
-  THTensor *linearGradOutput = luaT_getfieldcheckudata(L, 1, "_multiBuffer", torch_Tensor);;
+  THTensor *linearGradOutput = luaT_getfieldcheckudata(L, 1, "_multiBuffer", torch_Tensor);
+  THLongTensor *offsets = (THLongTensor*)luaT_getfieldcheckudata(L, 1, "_multiOffsets", "torch.LongTensor");
   
   THTensor *gradWeight = luaT_getfieldcheckudata(L, 1, "gradWeight", torch_Tensor);
   THTensor *gradBias = luaT_getfieldcheckudata(L, 1, "gradBias", torch_Tensor);
   
-  lua_getfield(L, 1, "updates");
-  
-  THIntTensor *node;
-  THTensor *nodeGradWeight, *nodeGradBias, *nodeInput, *nodeGradOutput;
-
-  long i;
+  nn_SoftMaxTreeStep *steps;
+  long *groups, *chunks;
+  real *input_data, *gradOutput_data;
+  long batchSize, nStep, nGroup, nChunk, s, g, c;
+  double work = 0, chunkWork;
+  int nThread = 1;
   
   luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
   luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
   
-  node = THIntTensor_new();
-  nodeGradWeight = THTensor_(new)();
-  nodeGradBias = THTensor_(new)();
-  nodeGradOutput = THTensor_(new)();
-  nodeInput = THTensor_(new)();
+  batchSize = input->size[0];
+  luaL_argcheck(L, offsets->nDimension == 1 && offsets->size[0] == batchSize+1 \
+    && linearGradOutput->size[0] == THLongTensor_get1d(offsets, batchSize), 2, \
+    "Backward performed on different inputs than last forward");
+
+  input = THTensor_(newContiguous)(input);
   
-  for(i = 0; i < input->size[0]; i++)
+  /* list the (sample, parent) pairs of the batch, bucketed by parent */
+  steps = (nn_SoftMaxTreeStep*)THAlloc(sizeof(nn_SoftMaxTreeStep)*batchSize*maxDept);
+  nStep = nn_SoftMaxTree_listSteps(target, pathTable, childPath, THLongTensor_data(offsets), steps);
+  if (nStep < 0)
+  {
+    THTensor_(free)(input);
+    THFree(steps);
+    luaL_argerror(L, 4, "Non-root node has no parent in tree.");
+  }
+    
+  /* first step of each parent */
+  groups = (long*)THAlloc(sizeof(long)*(nStep+1));
+  nGroup = 0;
+  for(s = 0; s < nStep; s++)
   {
-    long n = 0;
-    long childId = (long)(THIntTensor_get1d(target, i)) - 1;
-    THTensor_(select)(nodeInput, input, 0, i);
+    if (s == 0 || steps[s].parentId != steps[s-1].parentId)
+      groups[nGroup++] = s;
+  }
+  groups[nGroup] = nStep;
+  
+  /* the parents visited by many samples (the root is visited by all of 
+   * them) are split into chunks of children, such that no single addmm 
+   * dominates the parallel loop. A chunk is {group, first child, nChildren} */
+#ifdef _OPENMP
+  nThread = omp_get_max_threads();
+#endif
+  for(g = 0; g < nGroup; g++)
+    work += (double)(groups[g+1] - groups[g])*steps[groups[g]].nChildren;
+  chunkWork = THMax(work/(4*nThread), 1);
+  chunks = (long*)THAlloc(sizeof(long)*3*(nGroup + (long)(4*nThread)));
+  nChunk = 0;
+  for(g = 0; g < nGroup; g++)
+  {
+    long nChildren = steps[groups[g]].nChildren;
+    long nPart = 1, first = 0, p;
+    if (nThread > 1)
+    {
+      nPart = (long)ceil((groups[g+1] - groups[g])*nChildren/chunkWork);
+      nPart = THMax(1, THMin(nPart, nChildren/NN_SOFTMAXTREE_MINCHUNK));
+    }
+    for(p = 0; p < nPart; p++)
+    {
+      long last = nChildren*(p+1)/nPart;
+      chunks[3*nChunk] = g;
+      chunks[3*nChunk+1] = first;
+      chunks[3*nChunk+2] = last - first;
+      nChunk++;
+      first = last;
+    }
+  }
+  
+  input_data = THTensor_(data)(input);
+  gradOutput_data = THTensor_(data)(linearGradOutput);
+  
+  /* each chunk owns its rows of gradWeight and gradBias, so that threads 
+   * never write to the same rows. The rows of a chunk visited by many 
+   * samples are accumulated with a single addmm. */
+#pragma omp parallel private(c)
+  {
+    THTensor *nodeGradWeight = THTensor_(new)();
+    THTensor *nodeGradBias = THTensor_(new)();
+    THTensor *nodeGradOutput = THTensor_(new)();
+    THTensor *nodeInput = THTensor_(new)();
+    THTensor *groupInput = THTensor_(new)();
+    THTensor *groupGradOutput = THTensor_(new)();
+    THTensor *groupGradOutputT = THTensor_(new)();
     
-    while(1)
+#pragma omp for schedule(dynamic, 1)
+    for(c = 0; c < nChunk; c++)
     {
-      long parentId, parentIdx, childIdx, nChildren;
-      double count;
-      /* get next Node in Tree */
-      THIntTensor_select(node, childParent, 0, childId);
-      parentId = (long)(THIntTensor_get1d(node, 0)) - 1;
-      childIdx = (long)(THIntTensor_get1d(node, 1)) - 1;
+      long start = groups[chunks[3*c]];
+      long nRow = groups[chunks[3*c]+1] - start;
+      long first = chunks[3*c+1];
+      long parentIdx = steps[start].parentIdx + first;
+      long nChildren = chunks[3*c+2];
       
-      luaL_argcheck(L, parentId != -2, 2, "Non-root node has no parent in tree.");
-      
-      THIntTensor_select(node, parentChildren, 0, parentId);
-      parentIdx = (long)(THIntTensor_get1d(node, 0)) - 1;
-      nChildren = (long)(THIntTensor_get1d(node, 1));
-      
-      THTensor_(narrow)(nodeGradOutput, linearGradOutput, 0, maxFamilyPath*i + n, nChildren);
       THTensor_(narrow)(nodeGradWeight, gradWeight, 0, parentIdx, nChildren);
       THTensor_(narrow)(nodeGradBias, gradBias, 0, parentIdx, nChildren);
       
-      THTensor_(addr)(nodeGradWeight, 1, nodeGradWeight, scale, nodeGradOutput, nodeInput);
-      THTensor_(cadd)(nodeGradBias, nodeGradBias, scale, nodeGradOutput);
+      if (nRow == 1)
+      {
+        THTensor_(select)(nodeInput, input, 0, steps[start].row);
+        THTensor_(narrow)(nodeGradOutput, linearGradOutput, 0, steps[start].offset + first, nChildren);
       
-      /* updates will contain parentId (key) sum of scales (value)*/
-      lua_pushinteger(L, (int)(parentId+1));
-      lua_gettable(L, -2);
-      count = lua_tonumber(L, -1) + scale;
-      lua_pop(L, 1);
+        THTensor_(addr)(nodeGradWeight, 1, nodeGradWeight, scale, nodeGradOutput, nodeInput);
+        THTensor_(cadd)(nodeGradBias, nodeGradBias, scale, nodeGradOutput);
+      }
+      else
+      {
+        real *group_data, *gradBias_data;
+        long r, d;
       
-      lua_pushinteger(L, (int)(parentId+1)); /* key */
-      lua_pushnumber(L, count); /* value */
-      lua_settable(L, -3);
+        /* gather the rows that visit this parent */
+        THTensor_(resize2d)(groupInput, nRow, inputSize);
+        THTensor_(resize2d)(groupGradOutput, nRow, nChildren);
+        group_data = THTensor_(data)(groupGradOutput);
+        for(r = 0; r < nRow; r++)
+        {
+          memcpy(THTensor_(data)(groupInput) + r*inputSize, 
+                 input_data + steps[start+r].row*inputSize, sizeof(real)*inputSize);
+          memcpy(group_data + r*nChildren, 
+                 gradOutput_data + steps[start+r].offset + first, sizeof(real)*nChildren);
+        }
       
-      n += nChildren;
-      /* Break when root is reached */
-      if (parentId == rootId) 
-      {
-        break;
+        THTensor_(transpose)(groupGradOutputT, groupGradOutput, 0, 1);
+        THTensor_(addmm)(nodeGradWeight, 1, nodeGradWeight, scale, groupGradOutputT, groupInput);
+        
+        gradBias_data = THTensor_(data)(nodeGradBias);
+        for(r = 0; r < nRow; r++, group_data += nChildren)
+        {
+          for(d = 0; d < nChildren; d++)
+            gradBias_data[d*nodeGradBias->stride[0]] += scale*group_data[d];
+        }
       }
-      childId = parentId;
     }
+    
+    THTensor_(free)(nodeGradWeight);
+    THTensor_(free)(nodeGradBias);
+    THTensor_(free)(nodeGradOutput);
+    THTensor_(free)(nodeInput);
+    THTensor_(free)(groupInput);
+    THTensor_(free)(groupGradOutput);
+    THTensor_(free)(groupGradOutputT);
   }
   
-  THIntTensor_free(node);
-  THTensor_(free)(nodeGradWeight);
-  THTensor_(free)(nodeGradBias);
-  THTensor_(free)(nodeGradOutput);
-  THTensor_(free)(nodeInput);
+  /* updates will contain parentId (key) sum of scales (value)*/
+  lua_getfield(L, 1, "updates");
+  for(g = 0; g < nGroup; g++)
+  {
+    long parentId = steps[groups[g]].parentId;
+    double count;
     
+    lua_pushinteger(L, (int)(parentId+1));
+    lua_gettable(L, -2);
+    count = lua_tonumber(L, -1) + scale*(groups[g+1] - groups[g]);
+    lua_pop(L, 1);
+    
+    lua_pushinteger(L, (int)(parentId+1)); /* key */
+    lua_pushnumber(L, count); /* value */
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  
+  THTensor_(free)(input);
+  THFree(chunks);
+  THFree(groups);
+  THFree(steps);
+  return 0;
+}
+
+/* Copies weight into the reduced-precision qweight used for inference : 
+ * a CharTensor with one scale per row in qscale (int8), or a ShortTensor 
+ * of IEEE binary16 values (half). */
+static int nn_(SoftMaxTree_quantize)(lua_State *L)
+{
+  const char *mode = luaL_checkstring(L, 2);
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+  THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
+  long nRow, r;
+
+  luaL_argcheck(L, weight->nDimension == 2 && weight->size[1] == inputSize, 1, "invalid weight");
+  weight = THTensor_(newContiguous)(weight);
+  nRow = weight->size[0];
+
+  if (strcmp(mode, "int8") == 0)
+  {
+    THCharTensor *qweight = (THCharTensor*)luaT_getfieldcheckudata(L, 1, "qweight", "torch.CharTensor");
+    THTensor *qscale = luaT_getfieldcheckudata(L, 1, "qscale", torch_Tensor);
+    THCharTensor_resize2d(qweight, nRow, inputSize);
+    THTensor_(resize1d)(qscale, nRow);
+
+#pragma omp parallel for private(r)
+    for(r = 0; r < nRow; r++)
+    {
+      real *weight_data = THTensor_(data)(weight) + r*inputSize;
+      signed char *qweight_data = (signed char*)THCharTensor_data(qweight) + r*inputSize;
+      real maxAbs = 0, scale;
+      long d;
+
+      for(d = 0; d < inputSize; d++)
+        maxAbs = THMax(maxAbs, fabs(weight_data[d]));
+      scale = maxAbs / 127;
+
+      for(d = 0; d < inputSize; d++)
+      {
+        real q = (scale > 0) ? weight_data[d] / scale : 0;
+        q = floor(q + 0.5);
+        qweight_data[d] = (signed char)THMax(-127, THMin(127, q));
+      }
+      THTensor_(data)(qscale)[r] = scale;
+    }
+  }
+  else if (strcmp(mode, "half") == 0)
+  {
+    THShortTensor *qweight = (THShortTensor*)luaT_getfieldcheckudata(L, 1, "qweight", "torch.ShortTensor");
+    real *weight_data = THTensor_(data)(weight);
+    unsigned short *qweight_data;
+    long n = nRow*inputSize;
+
+    THShortTensor_resize2d(qweight, nRow, inputSize);
+    qweight_data = (unsigned short*)THShortTensor_data(qweight);
+
+#pragma omp parallel for private(r)
+    for(r = 0; r < n; r++)
+      qweight_data[r] = nn_SoftMaxTree_float2half((float)weight_data[r]);
+  }
+  else
+  {
+    THTensor_(free)(weight);
+    luaL_argerror(L, 2, "int8 | half expected");
+  }
+
+  THTensor_(free)(weight);
+  return 0;
+}
+
+/* Same as updateOutput, but with the reduced-precision weights of
+ * quantize(), which are dequantized on the fly by the dot products.
+ * Inference only : the buffers of the backward are left untouched. */
+static int nn_(SoftMaxTree_updateOutputQuantized)(lua_State *L)
+{
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
+  THIntTensor *target = (THIntTensor*)luaT_checkudata(L, 3, "torch.IntTensor");
+  const char *mode = luaT_getfieldcheckstring(L, 1, "quantized");
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+  long maxFamily = (long)luaT_getfieldcheckint(L, 1, "maxFamily");
+
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
+
+  THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+
+  THCharTensor *qweight8 = NULL;
+  THShortTensor *qweight16 = NULL;
+  real *scale_data = NULL;
+  long i;
+
+  luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
+  luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
+
+  if (strcmp(mode, "int8") == 0)
+  {
+    THTensor *qscale = luaT_getfieldcheckudata(L, 1, "qscale", torch_Tensor);
+    qweight8 = (THCharTensor*)luaT_getfieldcheckudata(L, 1, "qweight", "torch.CharTensor");
+    luaL_argcheck(L, THCharTensor_isContiguous(qweight8) && THTensor_(isContiguous)(qscale), 1, \
+      "contiguous qweight expected");
+    scale_data = THTensor_(data)(qscale);
+  }
+  else if (strcmp(mode, "half") == 0)
+  {
+    qweight16 = (THShortTensor*)luaT_getfieldcheckudata(L, 1, "qweight", "torch.ShortTensor");
+    luaL_argcheck(L, THShortTensor_isContiguous(qweight16), 1, "contiguous qweight expected");
+  }
+  else
+    luaL_argerror(L, 1, "quantized should be int8 | half");
+
+  /* check the targets before going parallel */
+  for(i = 0; i < input->size[0]; i++)
+  {
+    long nStep;
+    nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+    luaL_argcheck(L, nStep > 0, 3, "Non-root node has no parent in tree.");
+  }
+
+  input = THTensor_(newContiguous)(input);
+  THTensor_(resize1d)(output, input->size[0]);
+
+#pragma omp parallel private(i)
+  {
+    real *linear_data = (real*)THAlloc(sizeof(real)*maxFamily);
+
+#pragma omp for
+    for(i = 0; i < input->size[0]; i++)
+    {
+      real *input_data = THTensor_(data)(input) + i*inputSize;
+      long nStep, k, c, d;
+      int *path = nn_SoftMaxTree_path(pathTable, childPath, (long)(THIntTensor_get1d(target, i)) - 1, &nStep);
+      accreal narrowsum = 0;
+
+      for(k = 0; k < nStep; k++, path += NN_PATH_SIZE)
+      {
+        long parentIdx = path[NN_PATH_PARENTIDX] - 1;
+        long childIdx = path[NN_PATH_CHILDIDX] - 1;
+        long nChildren = path[NN_PATH_NCHILDREN];
+        accreal logsum = 0;
+        real maxInput = -THInf;
+
+        /* Linear */
+        for(c = 0; c < nChildren; c++)
+        {
+          long row = parentIdx + c;
+          accreal dot = 0;
+          if (qweight8)
+          {
+            signed char *weight_data = (signed char*)THCharTensor_data(qweight8) + row*inputSize;
+            for(d = 0; d < inputSize; d++)
+              dot += weight_data[d]*input_data[d];
+            dot *= scale_data[row];
+          }
+          else
+          {
+            unsigned short *weight_data = (unsigned short*)THShortTensor_data(qweight16) + row*inputSize;
+            for(d = 0; d < inputSize; d++)
+              dot += nn_SoftMaxTree_half2float(weight_data[d])*input_data[d];
+          }
+          linear_data[c] = dot + THTensor_(get1d)(bias, row);
+        }
+
+        /* LogSoftMax */
+        for(c = 0; c < nChildren; c++)
+          maxInput = THMax(maxInput, linear_data[c]);
+
+        for(c = 0; c < nChildren; c++)
+          logsum += THExpMinusApprox(maxInput-linear_data[c]);
+        logsum = maxInput + log(logsum);
+
+        /* Narrow + CAddTable */
+        narrowsum += linear_data[childIdx] - logsum;
+      }
+      THTensor_(set1d)(output, i, narrowsum);
+    }
+
+    THFree(linear_data);
+  }
+
+  THTensor_(free)(input);
+  return 1;
+}
+
+/* Fused sparse SGD step over the parents touched since the last
+ * zeroGradParameters (the keys of updates), or over all the parents if
+ * none were touched. Each row of a parent gets in one pass : the
+ * momentum (if any) and SGD updates, the max-norm constraint on its
+ * weights (if maxNorm > 0), and the zeroing of its gradients (if
+ * zeroGrad, in which case the touched parents are also removed from
+ * updates). */
+static int nn_(SoftMaxTree_sparseStep)(lua_State *L)
+{
+  real learningRate = luaL_checknumber(L, 2);
+  real momentum = luaL_optnumber(L, 3, 0);
+  real maxNorm = luaL_optnumber(L, 4, 0);
+  int zeroGrad = lua_toboolean(L, 5);
+  int update = (learningRate != 0);
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+
+  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+  THIntTensor *parentIds = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentIds", "torch.IntTensor");
+
+  THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
+  THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
+  THTensor *gradWeight = NULL, *gradBias = NULL;
+  THTensor *momGradWeight = NULL, *momGradBias = NULL;
+
+  real *weight_data, *bias_data;
+  real *gradWeight_data = NULL, *gradBias_data = NULL;
+  real *momWeight_data = NULL, *momBias_data = NULL;
+  long *parents;
+  long nParent, p;
+
+  luaL_argcheck(L, THTensor_(isContiguous)(weight) && THTensor_(isContiguous)(bias), 1, \
+    "contiguous parameters expected");
+
+  if (update || zeroGrad)
+  {
+    gradWeight = luaT_getfieldcheckudata(L, 1, "gradWeight", torch_Tensor);
+    gradBias = luaT_getfieldcheckudata(L, 1, "gradBias", torch_Tensor);
+    luaL_argcheck(L, THTensor_(isContiguous)(gradWeight) && THTensor_(isContiguous)(gradBias), 1, \
+      "contiguous gradParameters expected");
+    gradWeight_data = THTensor_(data)(gradWeight);
+    gradBias_data = THTensor_(data)(gradBias);
+  }
+
+  if (update && momentum != 0)
+  {
+    momGradWeight = luaT_checkudata(L, 6, torch_Tensor);
+    momGradBias = luaT_checkudata(L, 7, torch_Tensor);
+    luaL_argcheck(L, THTensor_(isContiguous)(momGradWeight) \
+      && THTensor_(nElement)(momGradWeight) == THTensor_(nElement)(weight), 6, \
+      "contiguous tensor of the size of weight expected");
+    luaL_argcheck(L, THTensor_(isContiguous)(momGradBias) \
+      && THTensor_(nElement)(momGradBias) == THTensor_(nElement)(bias), 7, \
+      "contiguous tensor of the size of bias expected");
+    momWeight_data = THTensor_(data)(momGradWeight);
+    momBias_data = THTensor_(data)(momGradBias);
+  }
+
+  weight_data = THTensor_(data)(weight);
+  bias_data = THTensor_(data)(bias);
+
+  /* list the touched parents */
+  lua_getfield(L, 1, "updates");
+  luaL_checktype(L, -1, LUA_TTABLE);
+  nParent = 0;
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0)
+  {
+    nParent++;
+    lua_pop(L, 1);
+  }
+
+  if (nParent > 0)
+  {
+    parents = (long*)THAlloc(sizeof(long)*nParent);
+    nParent = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0)
+    {
+      parents[nParent++] = (long)lua_tointeger(L, -2) - 1;
+      lua_pop(L, 1);
+    }
+  }
+  else
+  {
+    nParent = parentIds->size[0];
+    parents = (long*)THAlloc(sizeof(long)*nParent);
+    for(p = 0; p < nParent; p++)
+      parents[p] = (long)THIntTensor_get1d(parentIds, p) - 1;
+  }
+
+  for(p = 0; p < nParent; p++)
+  {
+    if (parents[p] < 0 || parents[p] >= parentChildren->size[0]
+        || THIntTensor_get2d(parentChildren, parents[p], 0) < 1)
+    {
+      THFree(parents);
+      luaL_error(L, "updates contains an invalid parentId");
+    }
+  }
+
+  /* parents own disjoint rows of the parameters */
+#pragma omp parallel for private(p)
+  for(p = 0; p < nParent; p++)
+  {
+    long start = (long)THIntTensor_get2d(parentChildren, parents[p], 0) - 1;
+    long nChildren = (long)THIntTensor_get2d(parentChildren, parents[p], 1);
+    long r, d;
+
+    for(r = start; r < start+nChildren; r++)
+    {
+      real *w = weight_data + r*inputSize;
+
+      if (update)
+      {
+        real *gw = gradWeight_data + r*inputSize;
+        if (momWeight_data)
+        {
+          real *mw = momWeight_data + r*inputSize;
+          for(d = 0; d < inputSize; d++)
+          {
+            mw[d] = momentum*mw[d] + gw[d];
+            w[d] -= learningRate*mw[d];
+          }
+          momBias_data[r] = momentum*momBias_data[r] + gradBias_data[r];
+          bias_data[r] -= learningRate*momBias_data[r];
+        }
+        else
+        {
+          for(d = 0; d < inputSize; d++)
+            w[d] -= learningRate*gw[d];
+          bias_data[r] -= learningRate*gradBias_data[r];
+        }
+      }
+
+      if (maxNorm > 0)
+      {
+        accreal norm = 0;
+        for(d = 0; d < inputSize; d++)
+          norm += w[d]*w[d];
+        norm = sqrt(norm);
+        if (norm > maxNorm)
+        {
+          real factor = maxNorm / (norm + 1e-7);
+          for(d = 0; d < inputSize; d++)
+            w[d] *= factor;
+        }
+      }
+
+      if (zeroGrad)
+      {
+        memset(gradWeight_data + r*inputSize, 0, sizeof(real)*inputSize);
+        gradBias_data[r] = 0;
+      }
+    }
+  }
+
+  /* keys are removed one by one in case updates is shared */
+  if (zeroGrad)
+  {
+    for(p = 0; p < nParent; p++)
+    {
+      lua_pushinteger(L, (int)(parents[p]+1));
+      lua_pushnil(L);
+      lua_settable(L, -3);
+    }
+  }
+  lua_pop(L, 1);
+
+  THFree(parents);
+  return 0;
+}
+
+/* Finds the k most likely leaves of each sample without targets. The 
+ * tree is searched best-first : the log-likelihood of a node is an upper 
+ * bound on that of the leaves below it, such that leaves come out of the 
+ * queue in decreasing order. Nodes that score below the k-th best leaf 
+ * found so far are never queued. */
+static int nn_(SoftMaxTree_topk)(lua_State *L)
+{
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
+  long k = luaL_checkinteger(L, 3);
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+  long rootId = (long)(luaT_getfieldcheckint(L, 1, "rootId") - 1);
+  long maxFamily = (long)luaT_getfieldcheckint(L, 1, "maxFamily");
+
+  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+  THIntTensor *childIds = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childIds", "torch.IntTensor");
+
+  THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
+  THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "_topkOutput", torch_Tensor);
+  THIntTensor *indices = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "_topkIndices", "torch.IntTensor");
+
+  int *parentChildren_data, *childIds_data;
+  long nParent, i;
+
+  luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
+  luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
+  luaL_argcheck(L, k > 0, 3, "k should be positive");
+
+  parentChildren = THIntTensor_newContiguous(parentChildren);
+  childIds = THIntTensor_newContiguous(childIds);
+  parentChildren_data = THIntTensor_data(parentChildren);
+  childIds_data = THIntTensor_data(childIds);
+  nParent = parentChildren->size[0];
+
+  THTensor_(resize2d)(output, input->size[0], k);
+  THIntTensor_resize2d(indices, input->size[0], k);
+
+#pragma omp parallel private(i)
+  {
+    THTensor *nodeWeight = THTensor_(new)();
+    THTensor *nodeBias = THTensor_(new)();
+    THTensor *nodeInput = THTensor_(new)();
+    THTensor *nodeOutput = THTensor_(newWithSize1d)(maxFamily);
+    long capacity = 1 + k*maxFamily;
+    nn_SoftMaxTreeNode *queue = (nn_SoftMaxTreeNode*)THAlloc(sizeof(nn_SoftMaxTreeNode)*capacity);
+    nn_SoftMaxTreeNode *best = (nn_SoftMaxTreeNode*)THAlloc(sizeof(nn_SoftMaxTreeNode)*k);
+
+#pragma omp for
+    for(i = 0; i < input->size[0]; i++)
+    {
+      long nQueue = 0, nBest = 0, nFound = 0, d;
+      nn_SoftMaxTreeNode node;
+
+      THTensor_(select)(nodeInput, input, 0, i);
+
+      node.score = 0;
+      node.nodeId = rootId;
+      nn_SoftMaxTree_heapPush(queue, &nQueue, node, 1);
+
+      while (nQueue > 0 && nFound < k)
+      {
+        long parentIdx, nChildren;
+        accreal logsum = 0;
+        real maxInput = -THInf;
+        real *linear_data;
+
+        node = nn_SoftMaxTree_heapPop(queue, &nQueue, 1);
+
+        /* leaves come out in decreasing order of log-likelihood */
+        if (node.nodeId >= nParent || parentChildren_data[2*node.nodeId+1] < 1)
+        {
+          THTensor_(set2d)(output, i, nFound, node.score);
+          THIntTensor_set2d(indices, i, nFound, node.nodeId+1);
+          nFound++;
+          continue;
+        }
+
+        parentIdx = parentChildren_data[2*node.nodeId] - 1;
+        nChildren = parentChildren_data[2*node.nodeId+1];
+
+        /* Linear */
+        THTensor_(narrow)(nodeWeight, weight, 0, parentIdx, nChildren);
+        THTensor_(narrow)(nodeBias, bias, 0, parentIdx, nChildren);
+        THTensor_(resize1d)(nodeOutput, nChildren);
+        THTensor_(addmv)(nodeOutput, 1, nodeBias, 1, nodeWeight, nodeInput);
+
+        /* LogSoftMax */
+        linear_data = THTensor_(data)(nodeOutput);
+        for(d = 0; d < nChildren; d++)
+          maxInput = THMax(maxInput, linear_data[d]);
+
+        for(d = 0; d < nChildren; d++)
+          logsum += THExpMinusApprox(maxInput-linear_data[d]);
+        logsum = maxInput + log(logsum);
+
+        if (nQueue + nChildren > capacity)
+        {
+          capacity = 2*(nQueue + nChildren);
+          queue = (nn_SoftMaxTreeNode*)THRealloc(queue, sizeof(nn_SoftMaxTreeNode)*capacity);
+        }
+
+        for(d = 0; d < nChildren; d++)
+        {
+          nn_SoftMaxTreeNode child;
+          child.score = node.score + linear_data[d] - logsum;
+          child.nodeId = (long)childIds_data[parentIdx+d] - 1;
+
+          /* prune subtrees that can't beat the k-th best leaf so far */
+          if (nBest == k && child.score <= best[0].score)
+            continue;
+
+          nn_SoftMaxTree_heapPush(queue, &nQueue, child, 1);
+
+          if (child.nodeId >= nParent || parentChildren_data[2*child.nodeId+1] < 1)
+          {
+            if (nBest == k)
+              nn_SoftMaxTree_heapPop(best, &nBest, -1);
+            nn_SoftMaxTree_heapPush(best, &nBest, child, -1);
+          }
+        }
+      }
+
+      /* trees with less than k leaves */
+      for(; nFound < k; nFound++)
+      {
+        THTensor_(set2d)(output, i, nFound, -THInf);
+        THIntTensor_set2d(indices, i, nFound, 0);
+      }
+    }
+
+    THTensor_(free)(nodeWeight);
+    THTensor_(free)(nodeBias);
+    THTensor_(free)(nodeInput);
+    THTensor_(free)(nodeOutput);
+    THFree(queue);
+    THFree(best);
+  }
+
+  THIntTensor_free(parentChildren);
+  THIntTensor_free(childIds);
+  return 0;
+}
+
+/* Log-likelihood of every node of the tree, without targets. The linear 
+ * part of all the nodes is computed with a single addmm. */
+static int nn_(SoftMaxTree_fullOutput)(lua_State *L)
+{
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
+  int inputSize = luaT_getfieldcheckint(L, 1, "inputSize");
+  long nChildNode = (long)luaT_getfieldcheckint(L, 1, "nChildNode");
+
+  THIntTensor *pathTable = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "pathTable", "torch.IntTensor");
+  THIntTensor *childPath = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "childPath", "torch.IntTensor");
+  THIntTensor *parentIds = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentIds", "torch.IntTensor");
+  THIntTensor *parentChildren = (THIntTensor*)luaT_getfieldcheckudata(L, 1, "parentChildren", "torch.IntTensor");
+
+  THTensor *weight = luaT_getfieldcheckudata(L, 1, "weight", torch_Tensor);
+  THTensor *bias = luaT_getfieldcheckudata(L, 1, "bias", torch_Tensor);
+  THTensor *linearOutput = luaT_getfieldcheckudata(L, 1, "_fullBuffer", torch_Tensor);
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "_fullOutput", torch_Tensor);
+
+  THTensor *weightTranspose, *linearRow;
+  long batchSize, nChild, i;
+
+  luaL_argcheck(L, input->nDimension == 2, 2, "2D(batch mode) tensor expected");
+  luaL_argcheck(L, input->size[1] == inputSize, 2, "invalid input size");
+
+  batchSize = input->size[0];
+  nChild = childPath->size[0];
+
+  /* Linear */
+  THTensor_(resize2d)(linearOutput, batchSize, nChildNode);
+  linearRow = THTensor_(new)();
+  for(i = 0; i < batchSize; i++)
+  {
+    THTensor_(select)(linearRow, linearOutput, 0, i);
+    THTensor_(copy)(linearRow, bias);
+  }
+  THTensor_(free)(linearRow);
+  weightTranspose = THTensor_(newTranspose)(weight, 0, 1);
+  THTensor_(addmm)(linearOutput, 1, linearOutput, 1, input, weightTranspose);
+  THTensor_(free)(weightTranspose);
+
+  THTensor_(resize2d)(output, batchSize, nChild);
+
+#pragma omp parallel for private(i)
+  for(i = 0; i < batchSize; i++)
+  {
+    real *linear_data = THTensor_(data)(linearOutput) + i*nChildNode;
+    real *output_data = THTensor_(data)(output) + i*output->stride[0];
+    long p, c, k, d;
+
+    /* LogSoftMax of each family */
+    for(p = 0; p < parentIds->size[0]; p++)
+    {
+      long parentId = (long)(THIntTensor_get1d(parentIds, p)) - 1;
+      real *family_data = linear_data + (long)(THIntTensor_get2d(parentChildren, parentId, 0)) - 1;
+      long nChildren = (long)(THIntTensor_get2d(parentChildren, parentId, 1));
+      accreal logsum = 0;
+      real maxInput = -THInf;
+
+      for(d = 0; d < nChildren; d++)
+        maxInput = THMax(maxInput, family_data[d]);
+
+      for(d = 0; d < nChildren; d++)
+        logsum += THExpMinusApprox(maxInput-family_data[d]);
+      logsum = maxInput + log(logsum);
+
+      for(d = 0; d < nChildren; d++)
+        family_data[d] -= logsum;
+    }
+
+    /* CAddTable along the path of each node */
+    for(c = 0; c < nChild; c++)
+    {
+      long nStep;
+      int *path = nn_SoftMaxTree_path(pathTable, childPath, c, &nStep);
+      accreal narrowsum = 0;
+
+      if (nStep < 1)
+      {
+        output_data[c*output->stride[1]] = -THInf;
+        continue;
+      }
+
+      for(k = 0; k < nStep; k++, path += NN_PATH_SIZE)
+        narrowsum += linear_data[path[NN_PATH_PARENTIDX] - 1 + path[NN_PATH_CHILDIDX] - 1];
+      output_data[c*output->stride[1]] = narrowsum;
+    }
+  }
+
   return 0;
 }
 
 static const struct luaL_Reg nn_(SoftMaxTree__) [] = {
+  {"SoftMaxTree_buildIndex", nn_SoftMaxTree_buildIndex},
   {"SoftMaxTree_updateOutput", nn_(SoftMaxTree_updateOutput)},
+  {"SoftMaxTree_updateOutputGrouped", nn_(SoftMaxTree_updateOutputGrouped)},
+  {"SoftMaxTree_forestOutput", nn_(SoftMaxTree_forestOutput)},
+  {"SoftMaxTree_updateOutputQuantized", nn_(SoftMaxTree_updateOutputQuantized)},
+  {"SoftMaxTree_quantize", nn_(SoftMaxTree_quantize)},
   {"SoftMaxTree_updateGradInput", nn_(SoftMaxTree_updateGradInput)},
   {"SoftMaxTree_accGradParameters", nn_(SoftMaxTree_accGradParameters)},
+  {"SoftMaxTree_sparseStep", nn_(SoftMaxTree_sparseStep)},
+  {"SoftMaxTree_topk", nn_(SoftMaxTree_topk)},
+  {"SoftMaxTree_fullOutput", nn_(SoftMaxTree_fullOutput)},
   {NULL, NULL}
 };
 
@@ -7,103 +7,160 @@
 #endif
 #define square(x) ((x)*(x))
 
+// checks a KxHxW input, or an NxKxHxW batch, and returns whether it is a batch
+static int nn_(SpatialGraph_checkInput)(lua_State *L, THTensor *input)
+{
+  int batch = (input->nDimension == 4);
+  luaL_argcheck(L, input->nDimension == 3 || batch, 2, "3D or 4D (batch mode) tensor expected");
+  return batch;
+}
+
 static int nn_(SpatialGraph_updateOutput)(lua_State *L)
 {
   // get all params
   THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
-  int connex = luaT_getfieldcheckint(L, 1, "connex");
+  THLongTensor *stencil = luaT_getfieldcheckudata(L, 1, "stencil", "torch.LongTensor");
   int dist = luaT_getfieldcheckint(L, 1, "dist");
   int norm = luaT_getfieldcheckint(L, 1, "normalize");
   THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
 
-  // dims
-  int iwidth = input->size[2];
-  int iheight = input->size[1];
-  int ichannels = input->size[0];
-  int owidth = iwidth;
-  int oheight = iheight;
-  int ochannels = connex / 2;
+  // dims (a 3D input is a batch of one sample)
+  int batch = nn_(SpatialGraph_checkInput)(L, input);
+  long nbatch = batch ? input->size[0] : 1;
+  int ichannels = input->size[batch];
+  int iheight = input->size[batch+1];
+  int iwidth = input->size[batch+2];
+  int ochannels = stencil->size[0];
+
+  // the stencil is an Ex2 list of (dx,dy) offsets: output channel e links
+  // each pixel (y,x) to its neighbor (y+dy,x+dx)
+  luaL_argcheck(L, stencil->nDimension == 2 && stencil->size[1] == 2, 1,
+                "stencil must be an Ex2 tensor of (dx,dy) offsets");
+  long *stencil_p = THLongTensor_data(stencil);
+  long *ss = stencil->stride;
 
   // norm ?
   double normer = (norm == 1) ? 1/sqrt(ichannels) : 1;
 
-  // zero output
-  THTensor_(zero)(output);
+  // epsilon added to the input by the cosine (to get rid of 0s)
+  const real epsi = 1e-12;
+
+  // get strides
+  long ibs = batch ? input->stride[0] : 0;
+  long obs = batch ? output->stride[0] : 0;
+  long *is = input->stride + batch;
+  long *os = output->stride + batch;
 
-  // Euclidean distance
+  // get pointers
+  real *input_p = THTensor_(data)(input);
+  real *output_p = THTensor_(data)(output);
+
+  // Euclidean distance: each row of each sample computes all the edges
+  // leaving its pixels, in one pass over the input
+  long r;
   if (dist == 0) {
-    // Sum[ (Xi - Xi+1)^2 ]
-    int x,y,k;
-    for (k=0; k<ichannels; k++) {
-      for (y=0; y<oheight; y++) {
-        for (x=0; x<owidth; x++) {
-          if (x < owidth-1) {
-            double temp = square(THTensor_(get3d)(input, k, y, x) - THTensor_(get3d)(input, k, y, x+1));
-            THTensor_(set3d)(output, 0, y, x, temp + THTensor_(get3d)(output, 0, y, x));
+#pragma omp parallel for private(r)
+    for (r = 0; r < nbatch*iheight; r++) {
+      real *in = input_p + (r/iheight)*ibs;
+      real *out = output_p + (r/iheight)*obs;
+      int y = r%iheight;
+      int x, e, k;
+      for (x = 0; x < iwidth; x++) {
+        real *a = in + y*is[1] + x*is[2];
+        for (e = 0; e < ochannels; e++) {
+          int xn = x + stencil_p[e*ss[0]];
+          int yn = y + stencil_p[e*ss[0] + ss[1]];
+          real *o = out + e*os[0] + y*os[1] + x*os[2];
+          if (xn < 0 || xn >= iwidth || yn < 0 || yn >= iheight) {
+            *o = 0;
+            continue;
           }
-          if (y < oheight-1) {
-            double temp = square(THTensor_(get3d)(input, k, y, x) - THTensor_(get3d)(input, k, y+1, x));
-            THTensor_(set3d)(output, 1, y, x, temp + THTensor_(get3d)(output, 1, y, x));
+          // Sqrt[ Sum[ (Xi - Xi+1)^2 ] ]
+          real *b = in + yn*is[1] + xn*is[2];
+          accreal sum = 0;
+          for (k = 0; k < ichannels; k++) {
+            real diff = a[k*is[0]] - b[k*is[0]];
+            sum += diff*diff;
           }
+          *o = sqrt(sum) * normer;
         }
       }
     }
+    return 1;
+  }
 
-    // Sqrt[ Sum[ (Xi - Xi+1)^2 ] ]
-    for (k=0; k<ochannels; k++) {
-      for (y=0; y<oheight; y++) {
-        for (x=0; x<owidth; x++) {
-          THTensor_(set3d)(output, k, y, x, sqrt(THTensor_(get3d)(output, k, y, x)) * normer);
-        }
-      }
-    }
-
-    // Cosine dissimilarity
+  // Cosine dissimilarity: the squared norm of each pixel and the dot product
+  // of each edge are kept for the backward
+  THTensor *norms = luaT_getfieldcheckudata(L, 1, "norms", torch_Tensor);
+  THTensor *dots = luaT_getfieldcheckudata(L, 1, "dots", torch_Tensor);
+  if (batch) {
+    THTensor_(resize3d)(norms, nbatch, iheight, iwidth);
+    THTensor_(resize4d)(dots, nbatch, ochannels, iheight, iwidth);
   } else {
-    // add epsilon to input (to get rid of 0s)
-    THTensor *inputb = THTensor_(newWithSize3d)(input->size[0], input->size[1], input->size[2]);
-    THTensor_(copy)(inputb, input);
-    THTensor_(add)(inputb, inputb, 1e-12);
+    THTensor_(resize2d)(norms, iheight, iwidth);
+    THTensor_(resize3d)(dots, ochannels, iheight, iwidth);
+  }
+  long nbs = batch ? norms->stride[0] : 0;
+  long dbs = batch ? dots->stride[0] : 0;
+  long *ns = norms->stride + batch;
+  long *ds = dots->stride + batch;
+  real *norms_p = THTensor_(data)(norms);
+  real *dots_p = THTensor_(data)(dots);
 
-    // Sum[ (Xi * Xi+1) ]
-    int x,y,k;
-    for (y=0; y<oheight; y++) {
-      for (x=0; x<owidth; x++) {
-        double norm_A = 0;
-        double norm_B = 0;
-        double norm_C = 0;
-        for (k=0; k<ichannels; k++) {
-          norm_A += square(THTensor_(get3d)(inputb, k, y, x));
-          if (x < owidth-1) {
-            double temp = THTensor_(get3d)(inputb, k, y, x) * THTensor_(get3d)(inputb, k, y, x+1);
-            THTensor_(set3d)(output, 0, y, x, temp + THTensor_(get3d)(output, 0, y, x));
-            norm_B += square(THTensor_(get3d)(inputb, k, y, x+1));
-          }
-          if (y < oheight-1) {
-            double temp = THTensor_(get3d)(inputb, k, y, x) * THTensor_(get3d)(inputb, k, y+1, x);
-            THTensor_(set3d)(output, 1, y, x, temp + THTensor_(get3d)(output, 1, y, x));
-            norm_C += square(THTensor_(get3d)(inputb, k, y+1, x));
-          }
-        }
-        if (x < owidth-1) {
-          if (norm) {
-            THTensor_(set3d)(output, 0, y, x, 1 - THTensor_(get3d)(output, 0, y, x) / (sqrt(norm_A) * sqrt(norm_B)));
-          } else {
-            THTensor_(set3d)(output, 0, y, x, ichannels - THTensor_(get3d)(output, 0, y, x));
-          }
-        }
-        if (y < oheight-1) {
-          if (norm) {
-            THTensor_(set3d)(output, 1, y, x, 1 - THTensor_(get3d)(output, 1, y, x) / (sqrt(norm_A) * sqrt(norm_C)));
-          } else {
-            THTensor_(set3d)(output, 1, y, x, ichannels - THTensor_(get3d)(output, 1, y, x));
+#pragma omp parallel private(r)
+  {
+    // the statistics, reading the input once
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      real *in = input_p + (r/iheight)*ibs;
+      real *nrm = norms_p + (r/iheight)*nbs;
+      real *dot = dots_p + (r/iheight)*dbs;
+      int y = r%iheight;
+      int x, e, k;
+      for (x = 0; x < iwidth; x++) {
+        real *a = in + y*is[1] + x*is[2];
+        accreal norm_A = 0;
+        for (k = 0; k < ichannels; k++)
+          norm_A += square(a[k*is[0]] + epsi);
+        nrm[y*ns[0] + x*ns[1]] = norm_A;
+        for (e = 0; e < ochannels; e++) {
+          int xn = x + stencil_p[e*ss[0]];
+          int yn = y + stencil_p[e*ss[0] + ss[1]];
+          accreal sum = 0;
+          if (xn >= 0 && xn < iwidth && yn >= 0 && yn < iheight) {
+            // Sum[ (Xi * Xi+1) ]
+            real *b = in + yn*is[1] + xn*is[2];
+            for (k = 0; k < ichannels; k++)
+              sum += (a[k*is[0]] + epsi) * (b[k*is[0]] + epsi);
           }
+          dot[e*ds[0] + y*ds[1] + x*ds[2]] = sum;
         }
       }
     }
 
-    // Cleanup
-    THTensor_(free)(inputb);
+    // the dissimilarities, once all the norms are known
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      real *nrm = norms_p + (r/iheight)*nbs;
+      real *dot = dots_p + (r/iheight)*dbs;
+      real *out = output_p + (r/iheight)*obs;
+      int y = r%iheight;
+      int x, e;
+      for (x = 0; x < iwidth; x++) {
+        for (e = 0; e < ochannels; e++) {
+          int xn = x + stencil_p[e*ss[0]];
+          int yn = y + stencil_p[e*ss[0] + ss[1]];
+          real *o = out + e*os[0] + y*os[1] + x*os[2];
+          real d = dot[e*ds[0] + y*ds[1] + x*ds[2]];
+          if (xn < 0 || xn >= iwidth || yn < 0 || yn >= iheight)
+            *o = 0;
+          else if (norm)
+            *o = 1 - d / (sqrt(nrm[y*ns[0] + x*ns[1]]) * sqrt(nrm[yn*ns[0] + xn*ns[1]]));
+          else
+            *o = ichannels - d;
+        }
+      }
+    }
   }
 
   return 1;
@@ -116,125 +173,118 @@ static int nn_(SpatialGraph_updateGradInput)(lua_State *L)
   THTensor *gradInput = luaT_getfieldcheckudata(L, 1, "gradInput", torch_Tensor);
   THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
   THTensor *gradOutput = luaT_checkudata(L, 3, torch_Tensor);
-  //int connex = luaT_getfieldcheckint(L, 1, "connex");
+  THLongTensor *stencil = luaT_getfieldcheckudata(L, 1, "stencil", "torch.LongTensor");
   int dist = luaT_getfieldcheckint(L, 1, "dist");
   int norm = luaT_getfieldcheckint(L, 1, "normalize");
 
-  // dims
-  //int iwidth = input->size[2];
-  //int iheight = input->size[1];
-  int ichannels = input->size[0];
-  int owidth = gradOutput->size[2];
-  int oheight = gradOutput->size[1];
-  //int ochannels = gradOutput->size[0];
+  // dims (a 3D input is a batch of one sample)
+  int batch = nn_(SpatialGraph_checkInput)(L, input);
+  long nbatch = batch ? input->size[0] : 1;
+  int ichannels = input->size[batch];
+  int iheight = input->size[batch+1];
+  int iwidth = input->size[batch+2];
+  int ochannels = stencil->size[0];
+
+  // the stencil is an Ex2 list of (dx,dy) offsets: output channel e links
+  // each pixel (y,x) to its neighbor (y+dy,x+dx)
+  long *stencil_p = THLongTensor_data(stencil);
+  long *ss = stencil->stride;
 
   // norm ?
   double normer = (norm == 1) ? 1/sqrt(ichannels)/sqrt(ichannels) : 1;
 
-  // resize gradInput
-  THTensor_(zero)(gradInput);
+  // epsilon added to the input by the cosine (to get rid of 0s)
+  const real epsi = 1e-12;
 
-  // compute derivatives, and backpropagate output error to input
-  if (dist == 0) {
-    int x,y,k;
-    for (k=0; k<ichannels; k++) {
-      for (y=0; y<oheight; y++) {
-        for (x=0; x<owidth; x++) {
-          if (x < owidth-1) {
-            double partial_d = THTensor_(get3d)(input, k, y, x) - THTensor_(get3d)(input, k, y, x+1);
-            if (partial_d != 0) partial_d /= THTensor_(get3d)(output, 0, y, x);
-            partial_d *= THTensor_(get3d)(gradOutput, 0, y, x) * normer;
-            THTensor_(set3d)(gradInput, k, y, x, partial_d + THTensor_(get3d)(gradInput, k, y, x));
-            THTensor_(set3d)(gradInput, k, y, x+1, -partial_d + THTensor_(get3d)(gradInput, k, y, x+1));
-          }
-          if (y < oheight-1) {
-            double partial_d = THTensor_(get3d)(input, k, y, x) - THTensor_(get3d)(input, k, y+1, x);
-            if (partial_d != 0) partial_d /= THTensor_(get3d)(output, 1, y, x);
-            partial_d *= THTensor_(get3d)(gradOutput, 1, y, x) * normer;
-            THTensor_(set3d)(gradInput, k, y, x, partial_d + THTensor_(get3d)(gradInput, k, y, x));
-            THTensor_(set3d)(gradInput, k, y+1, x, -partial_d + THTensor_(get3d)(gradInput, k, y+1, x));
-          }
-        }
-      }
-    }
+  // get strides
+  long ibs = batch ? input->stride[0] : 0;
+  long gibs = batch ? gradInput->stride[0] : 0;
+  long obs = batch ? output->stride[0] : 0;
+  long gobs = batch ? gradOutput->stride[0] : 0;
+  long *is = input->stride + batch;
+  long *gis = gradInput->stride + batch;
+  long *os = output->stride + batch;
+  long *gos = gradOutput->stride + batch;
 
-    // Cosine
-  } else {
-    int x,y,k;
-    for (y=0; y<oheight; y++) {
-      for (x=0; x<owidth; x++) {
-        double sum_A = 0;
-        double sum_B = 0;
-        double sum_C = 0;
-        double sum_AB = 0;
-        double sum_AC = 0;
+  // get pointers
+  real *input_p = THTensor_(data)(input);
+  real *gradInput_p = THTensor_(data)(gradInput);
+  real *output_p = THTensor_(data)(output);
+  real *gradOutput_p = THTensor_(data)(gradOutput);
 
-        if (norm) {
-          for (k=0; k<ichannels; k++) {
-            sum_A += square(THTensor_(get3d)(input, k, y, x));
-            if (x < owidth-1) {
-              sum_B += square(THTensor_(get3d)(input, k, y, x+1));
-              sum_AB += THTensor_(get3d)(input, k, y, x) * THTensor_(get3d)(input, k, y, x+1);
-            }
-            if (y < oheight-1) {
-              sum_C += square(THTensor_(get3d)(input, k, y+1, x));
-              sum_AC += THTensor_(get3d)(input, k, y, x) * THTensor_(get3d)(input, k, y+1, x);
-            }
-          }
-        }
+  // the cosine statistics of the forward
+  long nbs = 0, dbs = 0;
+  long *ns = NULL, *ds = NULL;
+  real *norms_p = NULL, *dots_p = NULL;
+  if (dist == 1 && norm) {
+    THTensor *norms = luaT_getfieldcheckudata(L, 1, "norms", torch_Tensor);
+    THTensor *dots = luaT_getfieldcheckudata(L, 1, "dots", torch_Tensor);
+    luaL_argcheck(L, dots->nDimension == input->nDimension
+                  && dots->size[0] == output->size[0]
+                  && dots->size[batch+1] == iheight && dots->size[batch+2] == iwidth, 2,
+                  "backward performed on a different input than the last forward");
+    nbs = batch ? norms->stride[0] : 0;
+    dbs = batch ? dots->stride[0] : 0;
+    ns = norms->stride + batch;
+    ds = dots->stride + batch;
+    norms_p = THTensor_(data)(norms);
+    dots_p = THTensor_(data)(dots);
+  }
 
-        double term1, term2, term3, partial_d;
-        double epsi = 1e-12;
-        if (x < owidth-1) {
-          if (norm) {
-            term1 = 1 / ( pow(sum_A, 1/2) * pow(sum_B, 1/2) + epsi );
-            term2 = sum_AB / ( pow(sum_A, 3/2) * pow(sum_B, 1/2) + epsi );
-            term3 = sum_AB / ( pow(sum_B, 3/2) * pow(sum_A, 1/2) + epsi );
-          }
-          for (k=0; k<ichannels; k++) {
-            if (norm) {
-              partial_d = term2 * THTensor_(get3d)(input, k, y, x)
-                - term1 * THTensor_(get3d)(input, k, y, x+1);
-            } else {
-              partial_d = -THTensor_(get3d)(input, k, y, x+1);
-            }
-            partial_d *= THTensor_(get3d)(gradOutput, 0, y, x);
-            THTensor_(set3d)(gradInput, k, y, x, partial_d + THTensor_(get3d)(gradInput, k, y, x));
+  // each pixel gathers the gradients of the edges leaving it (to p+e) and
+  // of the edges arriving to it (from p-e): the distances are symmetric, so
+  // both have the same form, and no two threads write the same pixel
+  long r;
+#pragma omp parallel for private(r)
+  for (r = 0; r < nbatch*iheight; r++) {
+    real *in = input_p + (r/iheight)*ibs;
+    real *gi = gradInput_p + (r/iheight)*gibs;
+    real *out = output_p + (r/iheight)*obs;
+    real *go = gradOutput_p + (r/iheight)*gobs;
+    real *nrm = norms_p ? norms_p + (r/iheight)*nbs : NULL;
+    real *dot = dots_p ? dots_p + (r/iheight)*dbs : NULL;
+    int y = r%iheight;
+    int x, e, s, k;
+    for (x = 0; x < iwidth; x++) {
+      real *a = in + y*is[1] + x*is[2];
+      real *ga = gi + y*gis[1] + x*gis[2];
+      for (k = 0; k < ichannels; k++)
+        ga[k*gis[0]] = 0;
 
-            if (norm) {
-              partial_d = term3 * THTensor_(get3d)(input, k, y, x+1)
-                - term1 * THTensor_(get3d)(input, k, y, x);
-            } else {
-              partial_d = -THTensor_(get3d)(input, k, y, x);
-            }
-            partial_d *= THTensor_(get3d)(gradOutput, 0, y, x);
-            THTensor_(set3d)(gradInput, k, y, x+1, partial_d + THTensor_(get3d)(gradInput, k, y, x+1));
-          }
-        }
-        if (y < oheight-1) {
-          if (norm) {
-            term1 = 1 / ( pow(sum_A, 1/2) * pow(sum_C, 1/2) + epsi );
-            term2 = sum_AC / ( pow(sum_A, 3/2) * pow(sum_C, 1/2) + epsi );
-            term3 = sum_AC / ( pow(sum_C, 3/2) * pow(sum_A, 1/2) + epsi );
-          }
-          for (k=0; k<ichannels; k++) {
-            if (norm) {
-              partial_d = term2 * THTensor_(get3d)(input, k, y, x)
-                - term1 * THTensor_(get3d)(input, k, y+1, x);
-            } else {
-              partial_d = -THTensor_(get3d)(input, k, y+1, x);
-            }
-            partial_d *= THTensor_(get3d)(gradOutput, 1, y, x);
-            THTensor_(set3d)(gradInput, k, y, x, partial_d + THTensor_(get3d)(gradInput, k, y, x));
+      for (e = 0; e < ochannels; e++) {
+        for (s = 1; s >= -1; s -= 2) {
+          // the other end of the edge, and the pixel the edge belongs to
+          int xn = x + s*stencil_p[e*ss[0]];
+          int yn = y + s*stencil_p[e*ss[0] + ss[1]];
+          if (xn < 0 || xn >= iwidth || yn < 0 || yn >= iheight)
+            continue;
+          int xe = (s > 0) ? x : xn;
+          int ye = (s > 0) ? y : yn;
+          real *b = in + yn*is[1] + xn*is[2];
+          real g = go[e*gos[0] + ye*gos[1] + xe*gos[2]];
+
+          // Euclidean: d/dXi = (Xi - Xj) / dist
+          if (dist == 0) {
+            real o = out[e*os[0] + ye*os[1] + xe*os[2]];
+            if (o == 0)
+              continue;
+            real c = g * normer / o;
+            for (k = 0; k < ichannels; k++)
+              ga[k*gis[0]] += c * (a[k*is[0]] - b[k*is[0]]);
 
-            if (norm) {
-              partial_d = term3 * THTensor_(get3d)(input, k, y+1, x)
-                - term1 * THTensor_(get3d)(input, k, y, x);
-            } else {
-              partial_d = -THTensor_(get3d)(input, k, y, x);
-            }
-            partial_d *= THTensor_(get3d)(gradOutput, 1, y, x);
-            THTensor_(set3d)(gradInput, k, y+1, x, partial_d + THTensor_(get3d)(gradInput, k, y+1, x));
+            // Cosine, normalized: d/dA = AB/(|A|^3|B|) A - 1/(|A||B|) B
+          } else if (norm) {
+            double norm_A = nrm[y*ns[0] + x*ns[1]];
+            double norm_B = nrm[yn*ns[0] + xn*ns[1]];
+            double term1 = 1 / (sqrt(norm_A) * sqrt(norm_B));
+            double term2 = dot[e*ds[0] + ye*ds[1] + xe*ds[2]] * term1 / norm_A;
+            for (k = 0; k < ichannels; k++)
+              ga[k*gis[0]] += g * (term2 * (a[k*is[0]] + epsi) - term1 * (b[k*is[0]] + epsi));
+
+            // Cosine: d/dA = -B
+          } else {
+            for (k = 0; k < ichannels; k++)
+              ga[k*gis[0]] -= g * (b[k*is[0]] + epsi);
           }
         }
       }
@@ -6,6 +6,357 @@
 #define max(x,y) (((x)>(y)) ? (x) : (y))
 #define min(x,y) (((x)>(y)) ? (y) : (x))
 
+#ifndef NN_SPATIALMATCHING_SIMD
+#define NN_SPATIALMATCHING_SIMD
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum { NN_MATCHING_L2, NN_MATCHING_GEMM, NN_MATCHING_CORRELATION };
+
+// reads self.mode (absent from modules saved before it existed)
+static int nn_SpatialMatching_mode(lua_State *L)
+{
+  int mode = NN_MATCHING_L2;
+  lua_getfield(L, 1, "mode");
+  if (!lua_isnil(L, -1)) {
+    const char *name = lua_tostring(L, -1);
+    if (name && !strcmp(name, "gemm"))
+      mode = NN_MATCHING_GEMM;
+    else if (name && !strcmp(name, "correlation"))
+      mode = NN_MATCHING_CORRELATION;
+    else if (!name || strcmp(name, "l2"))
+      luaL_error(L, "unknown matching mode (expecting l2, gemm or correlation)");
+  }
+  lua_pop(L, 1);
+  return mode;
+}
+#endif
+
+#ifndef NN_SPATIALMATCHING_SHARED
+#define NN_SPATIALMATCHING_SHARED
+// helpers shared with SpatialRadialMatching (included after this file)
+
+// checks a pair of KxHxW inputs, or of NxKxHxW batches, given their
+// dimensions and sizes, and returns whether they are batches
+static int nn_SpatialMatching_checkInputs(lua_State *L, int ndim1, long *size1, int ndim2, long *size2)
+{
+  int batch = (ndim1 == 4);
+  luaL_argcheck(L, ndim1 == 3 || batch, 2, "3D or 4D (batch mode) tensor expected");
+  luaL_argcheck(L, ndim2 == ndim1 && size2[0] == size1[0] && size2[batch] == size1[batch], 3,
+                "inputs must have the same number of samples and of channels");
+  return batch;
+}
+
+// vertex of the parabola through the costs at -1, 0, +1 (within half a pixel)
+static double nn_SpatialMatching_parabola(double cm, double c0, double cp)
+{
+  double denom = cm - 2*c0 + cp;
+  double offset;
+  if (denom == 0)
+    return 0;
+  offset = (cm - cp)/(2*denom);
+  return max(-0.5, min(0.5, offset));
+}
+#endif
+
+// vector ops for the distance kernel (none: plain C)
+#if defined(__AVX__) && defined(TH_REAL_IS_FLOAT)
+#define NN_VEC __m256
+#define NN_VLEN 8
+#define NN_VZERO _mm256_setzero_ps()
+#define NN_VLOAD _mm256_loadu_ps
+#define NN_VSTORE _mm256_storeu_ps
+#define NN_VSUB _mm256_sub_ps
+#define NN_VADD _mm256_add_ps
+#define NN_VMUL _mm256_mul_ps
+#elif defined(__AVX__) && defined(TH_REAL_IS_DOUBLE)
+#define NN_VEC __m256d
+#define NN_VLEN 4
+#define NN_VZERO _mm256_setzero_pd()
+#define NN_VLOAD _mm256_loadu_pd
+#define NN_VSTORE _mm256_storeu_pd
+#define NN_VSUB _mm256_sub_pd
+#define NN_VADD _mm256_add_pd
+#define NN_VMUL _mm256_mul_pd
+#elif defined(__SSE2__) && defined(TH_REAL_IS_FLOAT)
+#define NN_VEC __m128
+#define NN_VLEN 4
+#define NN_VZERO _mm_setzero_ps()
+#define NN_VLOAD _mm_loadu_ps
+#define NN_VSTORE _mm_storeu_ps
+#define NN_VSUB _mm_sub_ps
+#define NN_VADD _mm_add_ps
+#define NN_VMUL _mm_mul_ps
+#elif defined(__SSE2__) && defined(TH_REAL_IS_DOUBLE)
+#define NN_VEC __m128d
+#define NN_VLEN 2
+#define NN_VZERO _mm_setzero_pd()
+#define NN_VLOAD _mm_loadu_pd
+#define NN_VSTORE _mm_storeu_pd
+#define NN_VSUB _mm_sub_pd
+#define NN_VADD _mm_add_pd
+#define NN_VMUL _mm_mul_pd
+#endif
+
+// copies a [N]xKxHxW input into a contiguous [N]xHxWxK (channels-last) buffer
+static void nn_(SpatialMatching_pack)(THTensor *packed, THTensor *input)
+{
+  THTensor *view;
+  int d = input->nDimension-3;
+  if (d)
+    THTensor_(resize4d)(packed, input->size[0], input->size[2], input->size[3], input->size[1]);
+  else
+    THTensor_(resize3d)(packed, input->size[1], input->size[2], input->size[0]);
+  view = THTensor_(newWithTensor)(packed);
+  THTensor_(transpose)(view, NULL, d+1, d+2);
+  THTensor_(transpose)(view, NULL, d, d+1);
+  THTensor_(copy)(view, input);
+  THTensor_(free)(view);
+}
+
+// the backward reuses the copies packed by the forward: packs input again
+// unless packed already has its channels-last sizes
+static void nn_(SpatialMatching_repack)(THTensor *packed, THTensor *input)
+{
+  int d = input->nDimension-3;
+  if (packed->nDimension != input->nDimension || (d && packed->size[0] != input->size[0])
+      || packed->size[d] != input->size[d+1] || packed->size[d+1] != input->size[d+2]
+      || packed->size[d+2] != input->size[d])
+    nn_(SpatialMatching_pack)(packed, input);
+}
+
+// squared L2 distances between the n-vector a and the nb (<= 4) n-vectors
+// b, b+bstride, b+2*bstride... such that each load of a serves 4 candidates
+static void nn_(SpatialMatching_dist)(const real *a, const real *b, long bstride, long n, int nb, real *dist)
+{
+  // missing candidates alias the first one
+  const real *b0 = b;
+  const real *b1 = b + (nb > 1 ? bstride : 0);
+  const real *b2 = b + (nb > 2 ? 2*bstride : 0);
+  const real *b3 = b + (nb > 3 ? 3*bstride : 0);
+  accreal d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+  long k = 0;
+#ifdef NN_VEC
+  NN_VEC s0 = NN_VZERO, s1 = NN_VZERO, s2 = NN_VZERO, s3 = NN_VZERO;
+  real sums[4][NN_VLEN];
+  int j;
+  for (; k + NN_VLEN <= n; k += NN_VLEN) {
+    NN_VEC va = NN_VLOAD(a+k), v;
+    v = NN_VSUB(va, NN_VLOAD(b0+k)); s0 = NN_VADD(s0, NN_VMUL(v, v));
+    v = NN_VSUB(va, NN_VLOAD(b1+k)); s1 = NN_VADD(s1, NN_VMUL(v, v));
+    v = NN_VSUB(va, NN_VLOAD(b2+k)); s2 = NN_VADD(s2, NN_VMUL(v, v));
+    v = NN_VSUB(va, NN_VLOAD(b3+k)); s3 = NN_VADD(s3, NN_VMUL(v, v));
+  }
+  NN_VSTORE(sums[0], s0);
+  NN_VSTORE(sums[1], s1);
+  NN_VSTORE(sums[2], s2);
+  NN_VSTORE(sums[3], s3);
+  for (j = 0; j < NN_VLEN; j++) {
+    d0 += sums[0][j]; d1 += sums[1][j]; d2 += sums[2][j]; d3 += sums[3][j];
+  }
+#endif
+  for (; k < n; k++) {
+    real ak = a[k];
+    d0 += square(ak - b0[k]);
+    d1 += square(ak - b1[k]);
+    d2 += square(ak - b2[k]);
+    d3 += square(ak - b3[k]);
+  }
+  dist[0] = d0;
+  if (nb > 1) dist[1] = d1;
+  if (nb > 2) dist[2] = d2;
+  if (nb > 3) dist[3] = d3;
+}
+
+// dot products of the n-vector a with the nb (<= 4) n-vectors
+// b, b+bstride, b+2*bstride... (as above)
+static void nn_(SpatialMatching_dot)(const real *a, const real *b, long bstride, long n, int nb, real *dot)
+{
+  const real *b0 = b;
+  const real *b1 = b + (nb > 1 ? bstride : 0);
+  const real *b2 = b + (nb > 2 ? 2*bstride : 0);
+  const real *b3 = b + (nb > 3 ? 3*bstride : 0);
+  accreal d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+  long k = 0;
+#ifdef NN_VEC
+  NN_VEC s0 = NN_VZERO, s1 = NN_VZERO, s2 = NN_VZERO, s3 = NN_VZERO;
+  real sums[4][NN_VLEN];
+  int j;
+  for (; k + NN_VLEN <= n; k += NN_VLEN) {
+    NN_VEC va = NN_VLOAD(a+k);
+    s0 = NN_VADD(s0, NN_VMUL(va, NN_VLOAD(b0+k)));
+    s1 = NN_VADD(s1, NN_VMUL(va, NN_VLOAD(b1+k)));
+    s2 = NN_VADD(s2, NN_VMUL(va, NN_VLOAD(b2+k)));
+    s3 = NN_VADD(s3, NN_VMUL(va, NN_VLOAD(b3+k)));
+  }
+  NN_VSTORE(sums[0], s0);
+  NN_VSTORE(sums[1], s1);
+  NN_VSTORE(sums[2], s2);
+  NN_VSTORE(sums[3], s3);
+  for (j = 0; j < NN_VLEN; j++) {
+    d0 += sums[0][j]; d1 += sums[1][j]; d2 += sums[2][j]; d3 += sums[3][j];
+  }
+#endif
+  for (; k < n; k++) {
+    real ak = a[k];
+    d0 += ak*b0[k];
+    d1 += ak*b1[k];
+    d2 += ak*b2[k];
+    d3 += ak*b3[k];
+  }
+  dot[0] = d0;
+  if (nb > 1) dot[1] = d1;
+  if (nb > 2) dot[2] = d2;
+  if (nb > 3) dot[3] = d3;
+}
+
+// max-heap of the (at most k) smallest keys of a pixel, with their
+// window index
+static void nn_(SpatialMatching_siftDown)(real *key, int *idx, int n, int i)
+{
+  for (;;) {
+    int c = 2*i+1;
+    real tk;
+    int ti;
+    if (c >= n) break;
+    if (c+1 < n && key[c+1] > key[c]) c++;
+    if (key[i] >= key[c]) break;
+    tk = key[i]; key[i] = key[c]; key[c] = tk;
+    ti = idx[i]; idx[i] = idx[c]; idx[c] = ti;
+    i = c;
+  }
+}
+
+static void nn_(SpatialMatching_heapPush)(real *key, int *idx, int *n, int k, real kv, int iv)
+{
+  int i = *n;
+  if (i == k) {
+    // replaces the worst kept key
+    if (kv < key[0]) {
+      key[0] = kv; idx[0] = iv;
+      nn_(SpatialMatching_siftDown)(key, idx, k, 0);
+    }
+    return;
+  }
+  (*n)++;
+  while (i > 0 && key[(i-1)/2] < kv) {
+    key[i] = key[(i-1)/2]; idx[i] = idx[(i-1)/2];
+    i = (i-1)/2;
+  }
+  key[i] = kv; idx[i] = iv;
+}
+
+// sorts the heap by increasing keys
+static void nn_(SpatialMatching_heapSort)(real *key, int *idx, int n)
+{
+  int m;
+  for (m = n-1; m > 0; m--) {
+    real tk = key[0]; int ti = idx[0];
+    key[0] = key[m]; idx[0] = idx[m];
+    key[m] = tk; idx[m] = ti;
+    nn_(SpatialMatching_siftDown)(key, idx, m, 0);
+  }
+}
+
+// distances (or correlations) through the expansion
+//   ||a-b||^2 = ||a||^2 + ||b||^2 - 2*a.b
+// where the cross terms of blocks of pixels x1 of a row of input1 with the
+// pixels x2 of a row of input2 they are matched with are computed by BLAS
+static void nn_(SpatialMatching_gemmOutput)(real *packed1_p, real *packed2_p, long nbatch,
+                                            int iheight, int iwidth, int i2height, int i2width,
+                                            int ichannels, int maxh, int maxw, int offh, int offw,
+                                            int full_output, int correlation,
+                                            real *output_p, long obs, long *os)
+{
+  int block = max(maxw, 8);
+  real *norm1 = NULL, *norm2 = NULL;
+  long i;
+
+  // squared norms, computed once per pixel
+  if (!correlation) {
+    norm1 = (real *)THAlloc(sizeof(real)*nbatch*iheight*iwidth);
+    norm2 = (real *)THAlloc(sizeof(real)*nbatch*i2height*i2width);
+#pragma omp parallel for private(i)
+    for (i = 0; i < nbatch*iheight*iwidth; i++) {
+      real *a = packed1_p + i*ichannels;
+      accreal sum = 0;
+      int k;
+      for (k = 0; k < ichannels; k++) sum += a[k]*a[k];
+      norm1[i] = sum;
+    }
+#pragma omp parallel for private(i)
+    for (i = 0; i < nbatch*i2height*i2width; i++) {
+      real *b = packed2_p + i*ichannels;
+      accreal sum = 0;
+      int k;
+      for (k = 0; k < ichannels; k++) sum += b[k]*b[k];
+      norm2[i] = sum;
+    }
+  }
+
+  // rows of all samples
+  long r;
+#pragma omp parallel private(r)
+  {
+    real *cross = (real *)THAlloc(sizeof(real)*block*(block+maxw-1));
+    int x1s, x1, x2, y1, y2, j;
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      long s = r/iheight;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      real *n2s = norm2 ? norm2 + s*i2height*i2width : NULL;
+      int y2s, y2e;
+      y1 = r%iheight;
+      y2s = y1-offh; y2e = y1-offh+maxh;
+      if (full_output) {
+        y2s = max(0, y2s); y2e = min(iheight, y2e);
+      }
+      for (y2 = y2s; y2 < y2e; y2++) {
+        for (x1s = 0; x1s < iwidth; x1s += block) {
+          int nx1 = min(block, iwidth-x1s);
+          int x2s = x1s-offw, x2e = x1s+nx1-1-offw+maxw;
+          if (full_output) {
+            x2s = max(0, x2s); x2e = min(iwidth, x2e);
+          }
+          int nx2 = x2e-x2s;
+          // cross[j][x2-x2s] = input1[y1][x1s+j] . input2[y2][x2]
+          THBlas_(gemm)('t', 'n', nx2, nx1, ichannels, 1,
+                        p2 + ((long)y2*i2width + x2s)*ichannels, ichannels,
+                        packed1_p + (r*iwidth + x1s)*ichannels, ichannels,
+                        0, cross, nx2);
+          for (j = 0; j < nx1; j++) {
+            real *c = cross + (long)j*nx2;
+            real *out;
+            int xs, xe;
+            x1 = x1s+j;
+            xs = max(x2s, x1-offw);
+            xe = min(x2e, x1-offw+maxw);
+            out = output_p + s*obs + y1*os[0] + x1*os[1] + (y2-y1+offh)*os[2];
+            if (correlation) {
+              for (x2 = xs; x2 < xe; x2++)
+                out[(x2-x1+offw)*os[3]] = c[x2-x2s];
+            } else {
+              real n1 = norm1[r*iwidth + x1];
+              real *n2 = n2s + (long)y2*i2width;
+              for (x2 = xs; x2 < xe; x2++)
+                out[(x2-x1+offw)*os[3]] = n1 + n2[x2] - 2*c[x2-x2s];
+            }
+          }
+        }
+      }
+    }
+    THFree(cross);
+  }
+
+  if (!correlation) {
+    THFree(norm1);
+    THFree(norm2);
+  }
+}
+
 static int nn_(SpatialMatching_updateOutput)(lua_State *L)
 {
   // get all params
@@ -15,177 +366,737 @@ static int nn_(SpatialMatching_updateOutput)(lua_State *L)
   int maxh = luaT_getfieldcheckint(L, 1, "maxh");
   int full_output = luaT_getfieldcheckboolean(L, 1, "full_output");
   THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+  THTensor *packed1 = luaT_getfieldcheckudata(L, 1, "_packed1", torch_Tensor);
+  THTensor *packed2 = luaT_getfieldcheckudata(L, 1, "_packed2", torch_Tensor);
+  int mode = nn_SpatialMatching_mode(L);
 
-  // dims
-  int iwidth = input1->size[2];
-  int iheight = input1->size[1];
-  int ichannels = input1->size[0];
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+  int i2height = input2->size[batch+1];
+  int i2width = input2->size[batch+2];
 
-  // make contiguous
-  //input1 = THTensor_(newContiguous)(input1);
-  //input2 = THTensor_(newContiguous)(input2);
-  //output = THTensor_(newContiguous)(output);
+  // channels-last copies of the inputs, such that the distances
+  // are reductions over contiguous vectors
+  nn_(SpatialMatching_pack)(packed1, input1);
+  nn_(SpatialMatching_pack)(packed2, input2);
 
-  // zero output
-  THTensor_(fill)(output, 1e30);
+  // unmatched entries (full_output): infinite distance, or no correlation
+  THTensor_(fill)(output, mode == NN_MATCHING_CORRELATION ? 0 : 1e30);
 
   // get strides
-  long *i1s = input1->stride;
-  long *i2s = input2->stride;
-  long *os  = output->stride;
+  long obs = batch ? output->stride[0] : 0;
+  long *os = output->stride + batch;
 
   // get pointers
-  real *input1_p = THTensor_(data)(input1);
-  real *input2_p = THTensor_(data)(input2);
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
   real *output_p = THTensor_(data)(output);
 
-  // compute output
-  int x1,y1,x2,y2,k;
-  real dist;
+  // window of x2,y2 : [x1-offw, x1-offw+maxw) (clipped if full_output)
+  int offh = 0, offw = 0;
   if (full_output) {
     // get halves of window size
-    int halfh1 = ceil((real)maxh/2)-1;
-    int halfh2 = floor((real)maxh/2)+1;
-    int halfw1 = ceil((real)maxw/2)-1;
-    int halfw2 = floor((real)maxw/2)+1;
-
-    long dy, dx;
-    
-    #pragma omp parallel for private(x1,x2,y2,k,dist,dy,dx)
-    for (y1 = 0; y1 < iheight; y1++) {
+    offh = ceil((real)maxh/2)-1;
+    offw = ceil((real)maxw/2)-1;
+  }
+
+  if (mode != NN_MATCHING_L2) {
+    nn_(SpatialMatching_gemmOutput)(packed1_p, packed2_p, nbatch, iheight, iwidth, i2height, i2width,
+                                    ichannels, maxh, maxw, offh, offw, full_output,
+                                    mode == NN_MATCHING_CORRELATION, output_p, obs, os);
+    return 1;
+  }
+
+  // compute output, over the rows of all samples
+  long r;
+#pragma omp parallel for private(r)
+  for (r = 0; r < nbatch*iheight; r++) {
+    long s = r/iheight;
+    int y1 = r%iheight;
+    real *p2 = packed2_p + s*i2height*i2width*ichannels;
+    int x1, x2, y2, j;
+    real dist[4];
+    for (x1 = 0; x1 < iwidth; x1++) {
+      real *a = packed1_p + (r*iwidth + x1)*ichannels;
+      real *out = output_p + s*obs + y1*os[0] + x1*os[1];
+      int y2s = y1-offh, y2e = y1-offh+maxh;
+      int x2s = x1-offw, x2e = x1-offw+maxw;
+      if (full_output) {
+        y2s = max(0, y2s); y2e = min(iheight, y2e);
+        x2s = max(0, x2s); x2e = min(iwidth, x2e);
+      }
+      for (y2 = y2s; y2 < y2e; y2++) {
+        real *b = p2 + ((long)y2*i2width)*ichannels;
+        real *outy = out + (y2-y1+offh)*os[2];
+        // 4 candidates x2 per pass
+        for (x2 = x2s; x2 < x2e; x2 += 4) {
+          int nb = min(4, x2e-x2);
+          nn_(SpatialMatching_dist)(a, b + (long)x2*ichannels, ichannels, ichannels, nb, dist);
+          for (j = 0; j < nb; j++)
+            outy[(x2+j-x1+offw)*os[3]] = dist[j];
+        }
+      }
+    }
+  }
+
+  // done
+  return 1;
+}
+
+static int nn_(SpatialMatching_updateGradInput)(lua_State *L)
+{
+  // get all params
+  THTensor *input1 = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *input2 = luaT_checkudata(L, 3, torch_Tensor);
+  THTensor *gradInput1 = luaT_getfieldcheckudata(L, 1, "gradInput1", torch_Tensor);
+  THTensor *gradInput2 = luaT_getfieldcheckudata(L, 1, "gradInput2", torch_Tensor);
+  THTensor *gradOutput = luaT_checkudata(L, 4, torch_Tensor);
+  THTensor *packed1 = luaT_getfieldcheckudata(L, 1, "_packed1", torch_Tensor);
+  THTensor *packed2 = luaT_getfieldcheckudata(L, 1, "_packed2", torch_Tensor);
+  int full_output = luaT_getfieldcheckboolean(L, 1, "full_output");
+  int maxw = luaT_getfieldcheckint(L, 1, "maxw");
+  int maxh = luaT_getfieldcheckint(L, 1, "maxh");
+  int correlation = (nn_SpatialMatching_mode(L) == NN_MATCHING_CORRELATION);
+
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+  int i2height = input2->size[batch+1];
+  int i2width = input2->size[batch+2];
+
+  // the channels-last copies made by the forward are reused
+  nn_(SpatialMatching_repack)(packed1, input1);
+  nn_(SpatialMatching_repack)(packed2, input2);
+
+  // get strides
+  long gi1bs = batch ? gradInput1->stride[0] : 0;
+  long gi2bs = batch ? gradInput2->stride[0] : 0;
+  long gobs = batch ? gradOutput->stride[0] : 0;
+  long *gi1s = gradInput1->stride + batch;
+  long *gi2s = gradInput2->stride + batch;
+  long *gos = gradOutput->stride + batch;
+  
+  // get pointers
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
+  real *gradInput1_p = THTensor_(data)(gradInput1);
+  real *gradInput2_p = THTensor_(data)(gradInput2);
+  real *gradOutput_p = THTensor_(data)(gradOutput);
+  
+  // window of x2,y2 : [x1-offw, x1-offw+maxw) (clipped if full_output)
+  int offh = 0, offw = 0;
+  int h2 = i2height, w2 = i2width;
+  if (full_output) {
+    offh = ceil((real)maxh/2)-1;
+    offw = ceil((real)maxw/2)-1;
+    h2 = iheight;
+    w2 = iwidth;
+  }
+
+  // with g = gradOutput[y1][x1][dy][dx] and the sums over matched pairs:
+  //   gradInput1[y1][x1] = 2 * sum(g) * input1[y1][x1] - 2 * sum(g * input2[y2][x2])
+  //   gradInput2[y2][x2] = 2 * sum(g) * input2[y2][x2] - 2 * sum(g * input1[y1][x1])
+  // (correlation: gradInput1 = sum(g * input2), gradInput2 = sum(g * input1))
+  // gradInput1 is computed for each (y1,x1) over its window, and gradInput2
+  // for each (y2,x2) by gathering the (y1,x1) whose window contains it,
+  // so every thread only writes the rows (of all samples) it owns
+  long r;
+#pragma omp parallel private(r)
+  {
+    accreal *acc = (accreal *)THAlloc(sizeof(accreal)*ichannels);
+    int x1, x2, y1, y2, k;
+
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      long s = r/iheight;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      y1 = r%iheight;
       for (x1 = 0; x1 < iwidth; x1++) {
-	for (y2 = max(0,y1-halfh1); y2 < min(iheight,y1+halfh2); y2++) {
-	  for (x2 = max(0,(x1-halfw1)); x2 < min(iwidth,x1+halfw2); x2++) {
-	    dist = 0;
-	    for (k = 0; k < ichannels; k++) {
-	      dist += square(input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]] - input2_p[k*i2s[0] + y2*i2s[1] + x2*i2s[2]]);
-	    }
-	    dy = y2-y1 + halfh1;
-	    dx = x2-x1 + halfw1;
-	    output_p[dy*os[2] + dx*os[3] + y1*os[0] + x1*os[1]] = dist;
-	  }
-	}
+        real *a = packed1_p + (r*iwidth + x1)*ichannels;
+        real *go = gradOutput_p + s*gobs + y1*gos[0] + x1*gos[1];
+        real *gi = gradInput1_p + s*gi1bs + y1*gi1s[1] + x1*gi1s[2];
+        int y2s = y1-offh, y2e = y1-offh+maxh;
+        int x2s = x1-offw, x2e = x1-offw+maxw;
+        accreal sumg = 0;
+        if (full_output) {
+          y2s = max(0, y2s); y2e = min(iheight, y2e);
+          x2s = max(0, x2s); x2e = min(iwidth, x2e);
+        }
+        for (k = 0; k < ichannels; k++) acc[k] = 0;
+        for (y2 = y2s; y2 < y2e; y2++) {
+          for (x2 = x2s; x2 < x2e; x2++) {
+            real g = go[(y2-y1+offh)*gos[2] + (x2-x1+offw)*gos[3]];
+            real *b = p2 + ((long)y2*i2width + x2)*ichannels;
+            sumg += g;
+            for (k = 0; k < ichannels; k++) acc[k] += g*b[k];
+          }
+        }
+        if (correlation) {
+          for (k = 0; k < ichannels; k++)
+            gi[k*gi1s[0]] += acc[k];
+        } else {
+          for (k = 0; k < ichannels; k++)
+            gi[k*gi1s[0]] += 2*(sumg*a[k] - acc[k]);
+        }
       }
     }
-    /*
-    real *input1_p_it_start = input1_p, *input1_p_it_end = input1_p+ichannels*i1s[0];
-    real *input1_p_it, *input2_p_it;
-    for (y1 = 0; y1 < iheight; y1++) {
-      for (x1 = 0; x1 < iwidth; x1++, ++input1_p_it_start, ++input1_p_it_end) {
-	for (y2 = max(0,y1-halfh1); y2 < min(iheight,y1+halfh2); y2++) {
-	  for (x2 = max(0,(x1-halfw1)); x2 < min(iwidth,x1+halfw2); x2++) {
-	    dist = 0;
-	    for (input1_p_it = input1_p_it_start, input2_p_it=input2_p+y2*i2s[1]+x2*i2s[2];
-		 input1_p_it != input1_p_it_end;
-		 input1_p_it += i1s[0], input2_p_it += i2s[0]) {
-	      dist += square(*input1_p_it - *input2_p_it);
-	    }
-	    dy = y2-y1 + halfh1;
-	    dx = x2-x1 + halfw1;
-	    output_p[dy*os[0] + dx*os[1] + y1*os[2] + x1*os[3]] = dist;
-	  }
-	}
+	      
+#pragma omp for
+    for (r = 0; r < nbatch*h2; r++) {
+      long s = r/h2;
+      real *p1 = packed1_p + s*iheight*iwidth*ichannels;
+      real *go = gradOutput_p + s*gobs;
+      y2 = r%h2;
+      for (x2 = 0; x2 < w2; x2++) {
+        real *b = packed2_p + ((s*i2height + y2)*i2width + x2)*ichannels;
+        real *gi = gradInput2_p + s*gi2bs + y2*gi2s[1] + x2*gi2s[2];
+        int y1s = max(0, y2+offh-maxh+1), y1e = min(iheight, y2+offh+1);
+        int x1s = max(0, x2+offw-maxw+1), x1e = min(iwidth, x2+offw+1);
+        accreal sumg = 0;
+        for (k = 0; k < ichannels; k++) acc[k] = 0;
+        for (y1 = y1s; y1 < y1e; y1++) {
+          for (x1 = x1s; x1 < x1e; x1++) {
+            real g = go[y1*gos[0] + x1*gos[1] + (y2-y1+offh)*gos[2] + (x2-x1+offw)*gos[3]];
+            real *a = p1 + ((long)y1*iwidth + x1)*ichannels;
+            sumg += g;
+            for (k = 0; k < ichannels; k++) acc[k] += g*a[k];
+          }
+        }
+        if (correlation) {
+          for (k = 0; k < ichannels; k++)
+            gi[k*gi2s[0]] += acc[k];
+        } else {
+          for (k = 0; k < ichannels; k++)
+            gi[k*gi2s[0]] += 2*(sumg*b[k] - acc[k]);
+        }
       }
     }
-    */
+
+    THFree(acc);
+  }
+
+  // done
+  return 1;
+}
+
+// keeps the k best matches of each pixel: output is HxWxk (sorted, best
+// first) and offsets is HxWxkx2, the (dy,dx) of each match in the window
+// (1-based, 0 when a clipped window has less than k candidates)
+static int nn_(SpatialMatching_updateOutputTopk)(lua_State *L)
+{
+  // get all params
+  THTensor *input1 = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *input2 = luaT_checkudata(L, 3, torch_Tensor);
+  int maxw = luaT_getfieldcheckint(L, 1, "maxw");
+  int maxh = luaT_getfieldcheckint(L, 1, "maxh");
+  int k = luaT_getfieldcheckint(L, 1, "k");
+  int full_output = luaT_getfieldcheckboolean(L, 1, "full_output");
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+  THShortTensor *offsets = luaT_getfieldcheckudata(L, 1, "offsets", "torch.ShortTensor");
+  THTensor *packed1 = luaT_getfieldcheckudata(L, 1, "_packed1", torch_Tensor);
+  THTensor *packed2 = luaT_getfieldcheckudata(L, 1, "_packed2", torch_Tensor);
+  int correlation = (nn_SpatialMatching_mode(L) == NN_MATCHING_CORRELATION);
+  luaL_argcheck(L, k > 0 && k <= maxh*maxw, 1, "k must be in [1, maxh*maxw]");
+  luaL_argcheck(L, maxh < 32768 && maxw < 32768, 1, "window too large for int16 offsets");
+
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+  int i2height = input2->size[batch+1];
+  int i2width = input2->size[batch+2];
+
+  nn_(SpatialMatching_pack)(packed1, input1);
+  nn_(SpatialMatching_pack)(packed2, input2);
+  if (batch) {
+    THTensor_(resize4d)(output, nbatch, iheight, iwidth, k);
+    THShortTensor_resize5d(offsets, nbatch, iheight, iwidth, k, 2);
   } else {
-#pragma omp parallel for private(y1,x1,x2,y2,k,dist)
-    for (y1 = 0; y1 < iheight; y1++) {
+    THTensor_(resize3d)(output, iheight, iwidth, k);
+    THShortTensor_resize4d(offsets, iheight, iwidth, k, 2);
+  }
+
+  // get strides
+  long obs = batch ? output->stride[0] : 0;
+  long ofbs = batch ? offsets->stride[0] : 0;
+  long *os = output->stride + batch;
+  long *ofs = offsets->stride + batch;
+
+  // get pointers
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
+  real *output_p = THTensor_(data)(output);
+  short *offsets_p = THShortTensor_data(offsets);
+
+  int offh = 0, offw = 0;
+  if (full_output) {
+    offh = ceil((real)maxh/2)-1;
+    offw = ceil((real)maxw/2)-1;
+  }
+
+  // the heap keys are the distances, or the opposite of the correlations
+  long r;
+#pragma omp parallel private(r)
+  {
+    real *key = (real *)THAlloc(sizeof(real)*k);
+    int *idx = (int *)THAlloc(sizeof(int)*k);
+    int x1, x2, y1, y2, i, j, n;
+    real score[4];
+
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      long s = r/iheight;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      y1 = r%iheight;
       for (x1 = 0; x1 < iwidth; x1++) {
-	for (y2 = y1; y2 < y1+maxh; y2++) {
-	  for (x2 = x1; x2 < x1+maxw; x2++) {
-	    dist = 0;
-	    for (k = 0; k < ichannels; k++) {
-	      dist += square(input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]] - input2_p[k*i2s[0] + y2*i2s[1] + x2*i2s[2]]);
-	    }
-	    output_p[(y2-y1)*os[2] + (x2-x1)*os[3] + y1*os[0] + x1*os[1]] = dist;
-	  }
-	}
+        real *a = packed1_p + (r*iwidth + x1)*ichannels;
+        real *out = output_p + s*obs + y1*os[0] + x1*os[1];
+        short *off = offsets_p + s*ofbs + y1*ofs[0] + x1*ofs[1];
+        int y2s = y1-offh, y2e = y1-offh+maxh;
+        int x2s = x1-offw, x2e = x1-offw+maxw;
+        if (full_output) {
+          y2s = max(0, y2s); y2e = min(iheight, y2e);
+          x2s = max(0, x2s); x2e = min(iwidth, x2e);
+        }
+        n = 0;
+        for (y2 = y2s; y2 < y2e; y2++) {
+          real *b = p2 + ((long)y2*i2width)*ichannels;
+          int dy = y2-y1+offh;
+          for (x2 = x2s; x2 < x2e; x2 += 4) {
+            int nb = min(4, x2e-x2);
+            if (correlation)
+              nn_(SpatialMatching_dot)(a, b + (long)x2*ichannels, ichannels, ichannels, nb, score);
+            else
+              nn_(SpatialMatching_dist)(a, b + (long)x2*ichannels, ichannels, ichannels, nb, score);
+            for (j = 0; j < nb; j++)
+              nn_(SpatialMatching_heapPush)(key, idx, &n, k,
+                                            correlation ? -score[j] : score[j],
+                                            dy*maxw + x2+j-x1+offw);
+          }
+        }
+        nn_(SpatialMatching_heapSort)(key, idx, n);
+        for (i = 0; i < n; i++) {
+          out[i*os[2]] = correlation ? -key[i] : key[i];
+          off[i*ofs[2]] = idx[i]/maxw + 1;
+          off[i*ofs[2] + ofs[3]] = idx[i]%maxw + 1;
+        }
+        for (; i < k; i++) {
+          out[i*os[2]] = correlation ? -1e30 : 1e30;
+          off[i*ofs[2]] = 0;
+          off[i*ofs[2] + ofs[3]] = 0;
+        }
       }
     }
+
+    THFree(key);
+    THFree(idx);
   }
-    
 
   // done
   return 1;
 }
 
-static int nn_(SpatialMatching_updateGradInput)(lua_State *L)
+// backward of the top-k output: the gradients only flow through the
+// kept matches (gradInput2 is gathered row by row, as in the dense case)
+static int nn_(SpatialMatching_updateGradInputTopk)(lua_State *L)
 {
   // get all params
   THTensor *input1 = luaT_checkudata(L, 2, torch_Tensor);
   THTensor *input2 = luaT_checkudata(L, 3, torch_Tensor);
+  THTensor *gradOutput = luaT_checkudata(L, 4, torch_Tensor);
   THTensor *gradInput1 = luaT_getfieldcheckudata(L, 1, "gradInput1", torch_Tensor);
   THTensor *gradInput2 = luaT_getfieldcheckudata(L, 1, "gradInput2", torch_Tensor);
-  THTensor *gradOutput = luaT_checkudata(L, 4, torch_Tensor);
+  THShortTensor *offsets = luaT_getfieldcheckudata(L, 1, "offsets", "torch.ShortTensor");
+  THTensor *packed1 = luaT_getfieldcheckudata(L, 1, "_packed1", torch_Tensor);
+  THTensor *packed2 = luaT_getfieldcheckudata(L, 1, "_packed2", torch_Tensor);
   int full_output = luaT_getfieldcheckboolean(L, 1, "full_output");
   int maxw = luaT_getfieldcheckint(L, 1, "maxw");
   int maxh = luaT_getfieldcheckint(L, 1, "maxh");
+  int k = luaT_getfieldcheckint(L, 1, "k");
+  int correlation = (nn_SpatialMatching_mode(L) == NN_MATCHING_CORRELATION);
 
-  // dims
-  int iwidth = input1->size[2];
-  int iheight = input1->size[1];
-  int ichannels = input1->size[0];
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+  int i2height = input2->size[batch+1];
+  int i2width = input2->size[batch+2];
+
+  luaL_argcheck(L, THShortTensor_nElement(offsets) == nbatch*iheight*iwidth*k*2, 2,
+                "Backward performed on different inputs than last forward");
+
+  // the channels-last copies made by the forward are reused
+  nn_(SpatialMatching_repack)(packed1, input1);
+  nn_(SpatialMatching_repack)(packed2, input2);
 
   // get strides
-  long *i1s = input1->stride;
-  long *i2s = input2->stride;
-  long *gi1s = gradInput1->stride;
-  long *gi2s = gradInput2->stride;
-  long *gos = gradOutput->stride;
-  
+  long gi1bs = batch ? gradInput1->stride[0] : 0;
+  long gi2bs = batch ? gradInput2->stride[0] : 0;
+  long gobs = batch ? gradOutput->stride[0] : 0;
+  long ofbs = batch ? offsets->stride[0] : 0;
+  long *gi1s = gradInput1->stride + batch;
+  long *gi2s = gradInput2->stride + batch;
+  long *gos = gradOutput->stride + batch;
+  long *ofs = offsets->stride + batch;
+
   // get pointers
-  real *input1_p = THTensor_(data)(input1);
-  real *input2_p = THTensor_(data)(input2);
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
   real *gradInput1_p = THTensor_(data)(gradInput1);
   real *gradInput2_p = THTensor_(data)(gradInput2);
   real *gradOutput_p = THTensor_(data)(gradOutput);
-  
-  // compute gradients
-  int x1, y1, x2, y2, k;
-  real partial_d;
+  short *offsets_p = THShortTensor_data(offsets);
+
+  int offh = 0, offw = 0;
+  int h2 = i2height;
   if (full_output) {
-    // get halves of window size
-    int halfh1 = ceil((real)maxh/2)-1;
-    int halfh2 = floor((real)maxh/2)+1;
-    int halfw1 = ceil((real)maxw/2)-1;
-    int halfw2 = floor((real)maxw/2)+1;
+    offh = ceil((real)maxh/2)-1;
+    offw = ceil((real)maxw/2)-1;
+    h2 = iheight;
+  }
 
-    long dy, dx;
-    //#pragma omp parallel for private(x1,x2,y2,k,dy,dx,partial_d) NO! gradInput has +=
+  long r;
+#pragma omp parallel private(r)
+  {
+    int x1, x2, y1, y2, i, c;
+
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      long s = r/iheight;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      real *go = gradOutput_p + s*gobs;
+      y1 = r%iheight;
+      for (x1 = 0; x1 < iwidth; x1++) {
+        real *a = packed1_p + (r*iwidth + x1)*ichannels;
+        real *gi = gradInput1_p + s*gi1bs + y1*gi1s[1] + x1*gi1s[2];
+        short *off = offsets_p + s*ofbs + y1*ofs[0] + x1*ofs[1];
+        for (i = 0; i < k; i++) {
+          real g, *b;
+          if (off[i*ofs[2]] == 0) continue;
+          y2 = y1 + off[i*ofs[2]]-1 - offh;
+          x2 = x1 + off[i*ofs[2] + ofs[3]]-1 - offw;
+          g = go[y1*gos[0] + x1*gos[1] + i*gos[2]];
+          b = p2 + ((long)y2*i2width + x2)*ichannels;
+          if (correlation) {
+            for (c = 0; c < ichannels; c++)
+              gi[c*gi1s[0]] += g*b[c];
+          } else {
+            for (c = 0; c < ichannels; c++)
+              gi[c*gi1s[0]] += 2*g*(a[c] - b[c]);
+          }
+        }
+      }
+    }
+
+#pragma omp for
+    for (r = 0; r < nbatch*h2; r++) {
+      long s = r/h2;
+      real *p1 = packed1_p + s*iheight*iwidth*ichannels;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      real *go = gradOutput_p + s*gobs;
+      int y1s, y1e;
+      y2 = r%h2;
+      y1s = max(0, y2+offh-maxh+1);
+      y1e = min(iheight, y2+offh+1);
+      for (y1 = y1s; y1 < y1e; y1++) {
+        int dy = y2-y1+offh+1;
+        for (x1 = 0; x1 < iwidth; x1++) {
+          real *a = p1 + ((long)y1*iwidth + x1)*ichannels;
+          short *off = offsets_p + s*ofbs + y1*ofs[0] + x1*ofs[1];
+          for (i = 0; i < k; i++) {
+            real g, *b, *gi;
+            if (off[i*ofs[2]] != dy) continue;
+            x2 = x1 + off[i*ofs[2] + ofs[3]]-1 - offw;
+            g = go[y1*gos[0] + x1*gos[1] + i*gos[2]];
+            b = p2 + ((long)y2*i2width + x2)*ichannels;
+            gi = gradInput2_p + s*gi2bs + y2*gi2s[1] + x2*gi2s[2];
+            if (correlation) {
+              for (c = 0; c < ichannels; c++)
+                gi[c*gi2s[0]] += g*a[c];
+            } else {
+              for (c = 0; c < ichannels; c++)
+                gi[c*gi2s[0]] -= 2*g*(a[c] - b[c]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // done
+  return 1;
+}
+
+// one level of the coarse-to-fine search: keeps the k best displacements
+// (dy,dx) in [dymin,dymax]x[dxmin,dxmax] of each pixel (y2 = y1+dy < h2,
+// x2 = x1+dx < w2), as in updateOutputTopk, with offsets in that window:
+// dy = offset-1+dymin. If the offsets of the coarser level are given, the
+// search is restricted to radius around twice the best coarse displacement.
+static int nn_(SpatialMatching_pyramidOutput)(lua_State *L)
+{
+  // get all params
+  THTensor *input1 = luaT_checkudata(L, 1, torch_Tensor);
+  THTensor *input2 = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *output = luaT_checkudata(L, 3, torch_Tensor);
+  THShortTensor *offsets = luaT_checkudata(L, 4, "torch.ShortTensor");
+  THTensor *packed1 = luaT_checkudata(L, 5, torch_Tensor);
+  THTensor *packed2 = luaT_checkudata(L, 6, torch_Tensor);
+  int dymin = luaL_checkinteger(L, 7);
+  int dymax = luaL_checkinteger(L, 8);
+  int dxmin = luaL_checkinteger(L, 9);
+  int dxmax = luaL_checkinteger(L, 10);
+  int h2 = luaL_checkinteger(L, 11);
+  int w2 = luaL_checkinteger(L, 12);
+  int k = luaL_checkinteger(L, 13);
+  int correlation = lua_toboolean(L, 14);
+  THShortTensor *coarse = luaT_toudata(L, 15, "torch.ShortTensor");
+  int cdymin = luaL_optinteger(L, 16, 0);
+  int cdxmin = luaL_optinteger(L, 17, 0);
+  int radius = luaL_optinteger(L, 18, 2);
+  int wh = dymax-dymin+1, ww = dxmax-dxmin+1;
+  luaL_argcheck(L, wh > 0 && ww > 0 && wh < 32768 && ww < 32768, 7, "invalid window");
+  luaL_argcheck(L, k > 0 && k <= wh*ww, 13, "k must be in [1, window size]");
+  luaL_argcheck(L, !coarse || coarse->nDimension == 4, 15, "offsets of the coarser level expected");
+  luaL_argcheck(L, input1->nDimension == 3 && input2->nDimension == 3, 1, "3D tensors expected");
+
+  // dims
+  int iwidth = input1->size[2];
+  int iheight = input1->size[1];
+  int ichannels = input1->size[0];
+  int i2width = input2->size[2];
+  h2 = min(h2, input2->size[1]);
+  w2 = min(w2, i2width);
+
+  nn_(SpatialMatching_pack)(packed1, input1);
+  nn_(SpatialMatching_pack)(packed2, input2);
+  THTensor_(resize3d)(output, iheight, iwidth, k);
+  THShortTensor_resize4d(offsets, iheight, iwidth, k, 2);
+
+  // get strides
+  long *os = output->stride;
+  long *ofs = offsets->stride;
+
+  // get pointers
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
+  real *output_p = THTensor_(data)(output);
+  short *offsets_p = THShortTensor_data(offsets);
+  short *coarse_p = coarse ? THShortTensor_data(coarse) : NULL;
+
+  int y1;
+#pragma omp parallel private(y1)
+  {
+    real *key = (real *)THAlloc(sizeof(real)*k);
+    int *idx = (int *)THAlloc(sizeof(int)*k);
+    int x1, dy, dx, i, j, n;
+    real score[4];
+
+#pragma omp for
     for (y1 = 0; y1 < iheight; y1++) {
       for (x1 = 0; x1 < iwidth; x1++) {
-	for (y2 = max(0,y1-halfh1); y2 < min(iheight,y1+halfh2); y2++) {
-	  for (x2 = max(0,(x1-halfw1)); x2 < min(iwidth,x1+halfw2); x2++) {
-	    dy = y2-y1 + halfh1;
-	    dx = x2-x1 + halfw1;
-	    for (k=0; k<ichannels; k++) {
-	      partial_d = 2*(input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]] - input2_p[k*i2s[0] + y2*i2s[1] + x2*i2s[2]]);
-	      partial_d *= gradOutput_p[dy*gos[2] + dx*gos[3] + y1*gos[0] + x1*gos[1]];
-	      gradInput1_p[k*gi1s[0] + y1*gi1s[1] + x1*gi1s[2]] += partial_d;
-	      gradInput2_p[k*gi2s[0] + y2*gi2s[1] + x2*gi2s[2]] -= partial_d;
-	    }
-	  }
-	}
+        real *a = packed1_p + ((long)y1*iwidth + x1)*ichannels;
+        real *out = output_p + y1*os[0] + x1*os[1];
+        short *off = offsets_p + y1*ofs[0] + x1*ofs[1];
+        int dys = dymin, dye = dymax, dxs = dxmin, dxe = dxmax;
+        if (coarse) {
+          // best match of the coarse pixel covering this one
+          long *cs = coarse->stride;
+          int cy = min(y1/2, coarse->size[0]-1), cx = min(x1/2, coarse->size[1]-1);
+          short *co = coarse_p + cy*cs[0] + cx*cs[1];
+          int py = 0, px = 0;
+          if (co[0]) {
+            py = 2*(co[0]-1+cdymin);
+            px = 2*(co[cs[3]]-1+cdxmin);
+          }
+          dys = max(dys, py-radius); dye = min(dye, py+radius);
+          dxs = max(dxs, px-radius); dxe = min(dxe, px+radius);
+        }
+        dys = max(dys, -y1); dye = min(dye, h2-1-y1);
+        dxs = max(dxs, -x1); dxe = min(dxe, w2-1-x1);
+        n = 0;
+        for (dy = dys; dy <= dye; dy++) {
+          real *b = packed2_p + ((long)(y1+dy)*i2width + x1)*ichannels;
+          for (dx = dxs; dx <= dxe; dx += 4) {
+            int nb = min(4, dxe-dx+1);
+            if (correlation)
+              nn_(SpatialMatching_dot)(a, b + (long)dx*ichannels, ichannels, ichannels, nb, score);
+            else
+              nn_(SpatialMatching_dist)(a, b + (long)dx*ichannels, ichannels, ichannels, nb, score);
+            for (j = 0; j < nb; j++)
+              nn_(SpatialMatching_heapPush)(key, idx, &n, k,
+                                            correlation ? -score[j] : score[j],
+                                            (dy-dymin)*ww + dx+j-dxmin);
+          }
+        }
+        nn_(SpatialMatching_heapSort)(key, idx, n);
+        for (i = 0; i < n; i++) {
+          out[i*os[2]] = correlation ? -key[i] : key[i];
+          off[i*ofs[2]] = idx[i]/ww + 1;
+          off[i*ofs[2] + ofs[3]] = idx[i]%ww + 1;
+        }
+        for (; i < k; i++) {
+          out[i*os[2]] = correlation ? -1e30 : 1e30;
+          off[i*ofs[2]] = 0;
+          off[i*ofs[2] + ofs[3]] = 0;
+        }
       }
     }
+
+    THFree(key);
+    THFree(idx);
+  }
+
+  return 0;
+}
+
+// winner-take-all, without the cost volume: output is the (dy,dx) of the
+// best match of each pixel (1-based, as in the dense output), subpixel the
+// parabolic refinement of each, and ratio the best cost over the second
+// best one (second best over best for correlations): the lower the surer
+static int nn_(SpatialMatching_updateOutputWTA)(lua_State *L)
+{
+  // get all params
+  THTensor *input1 = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *input2 = luaT_checkudata(L, 3, torch_Tensor);
+  int maxw = luaT_getfieldcheckint(L, 1, "maxw");
+  int maxh = luaT_getfieldcheckint(L, 1, "maxh");
+  int full_output = luaT_getfieldcheckboolean(L, 1, "full_output");
+  THTensor *output = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+  THTensor *subpixel = luaT_getfieldcheckudata(L, 1, "subpixel", torch_Tensor);
+  THTensor *ratio = luaT_getfieldcheckudata(L, 1, "ratio", torch_Tensor);
+  THTensor *packed1 = luaT_getfieldcheckudata(L, 1, "_packed1", torch_Tensor);
+  THTensor *packed2 = luaT_getfieldcheckudata(L, 1, "_packed2", torch_Tensor);
+  int correlation = (nn_SpatialMatching_mode(L) == NN_MATCHING_CORRELATION);
+
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+  int i2height = input2->size[batch+1];
+  int i2width = input2->size[batch+2];
+
+  nn_(SpatialMatching_pack)(packed1, input1);
+  nn_(SpatialMatching_pack)(packed2, input2);
+  if (batch) {
+    THTensor_(resize4d)(output, nbatch, iheight, iwidth, 2);
+    THTensor_(resize4d)(subpixel, nbatch, iheight, iwidth, 2);
+    THTensor_(resize3d)(ratio, nbatch, iheight, iwidth);
   } else {
-    //#pragma omp parallel for private(x1,x2,y2,k,partial_d)
-    for (y1 = 0; y1 < iheight; y1++) {
+    THTensor_(resize3d)(output, iheight, iwidth, 2);
+    THTensor_(resize3d)(subpixel, iheight, iwidth, 2);
+    THTensor_(resize2d)(ratio, iheight, iwidth);
+  }
+
+  // get strides
+  long obs = batch ? output->stride[0] : 0;
+  long sbs = batch ? subpixel->stride[0] : 0;
+  long rbs = batch ? ratio->stride[0] : 0;
+  long *os = output->stride + batch;
+  long *ss = subpixel->stride + batch;
+  long *rs = ratio->stride + batch;
+
+  // get pointers
+  real *packed1_p = THTensor_(data)(packed1);
+  real *packed2_p = THTensor_(data)(packed2);
+  real *output_p = THTensor_(data)(output);
+  real *subpixel_p = THTensor_(data)(subpixel);
+  real *ratio_p = THTensor_(data)(ratio);
+
+  int offh = 0, offw = 0;
+  if (full_output) {
+    offh = ceil((real)maxh/2)-1;
+    offw = ceil((real)maxw/2)-1;
+  }
+
+  long r;
+#pragma omp parallel private(r)
+  {
+    // costs of the window of one pixel
+    real *cost = (real *)THAlloc(sizeof(real)*maxh*maxw);
+    int x1, x2, y1, y2;
+
+#pragma omp for
+    for (r = 0; r < nbatch*iheight; r++) {
+      long s = r/iheight;
+      real *p2 = packed2_p + s*i2height*i2width*ichannels;
+      y1 = r%iheight;
       for (x1 = 0; x1 < iwidth; x1++) {
-	for (y2 = y1; y2 < y1+maxh; y2++) {
-	  for (x2 = x1; x2 < x1+maxw; x2++) {
-	    for (k = 0; k < ichannels; k++) {
-	      partial_d = 2*(input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]] - input2_p[k*i2s[0] + y2*i2s[1] + x2*i2s[2]]);
-	      partial_d *= gradOutput_p[(y2-y1)*gos[2]+(x2-x1)*gos[3]+y1*gos[0]+x1*gos[1]];
-	      gradInput1_p[k*gi1s[0] + y1*gi1s[1] + x1*gi1s[2]] += partial_d;
-	      gradInput2_p[k*gi2s[0] + y2*gi2s[1] + x2*gi2s[2]] -= partial_d;
-	      
-	    }
-	  }
-	}
+        real *a = packed1_p + (r*iwidth + x1)*ichannels;
+        real *out = output_p + s*obs + y1*os[0] + x1*os[1];
+        real *sub = subpixel_p + s*sbs + y1*ss[0] + x1*ss[1];
+        real *rat = ratio_p + s*rbs + y1*rs[0] + x1*rs[1];
+        int y2s = y1-offh, y2e = y1-offh+maxh;
+        int x2s = x1-offw, x2e = x1-offw+maxw;
+        int dys, dye, dxs, dxe, dy, dx, n = 0, best = 0;
+        real bv = 0, sv = 0, c0, b, sb;
+        if (full_output) {
+          y2s = max(0, y2s); y2e = min(iheight, y2e);
+          x2s = max(0, x2s); x2e = min(iwidth, x2e);
+        }
+        dys = y2s-y1+offh; dye = y2e-y1+offh;
+        dxs = x2s-x1+offw; dxe = x2e-x1+offw;
+        for (y2 = y2s; y2 < y2e; y2++) {
+          real *b2 = p2 + ((long)y2*i2width)*ichannels;
+          real *c = cost + (y2-y1+offh)*maxw;
+          for (x2 = x2s; x2 < x2e; x2 += 4) {
+            int nb = min(4, x2e-x2);
+            if (correlation)
+              nn_(SpatialMatching_dot)(a, b2 + (long)x2*ichannels, ichannels, ichannels, nb, c + x2-x1+offw);
+            else
+              nn_(SpatialMatching_dist)(a, b2 + (long)x2*ichannels, ichannels, ichannels, nb, c + x2-x1+offw);
+          }
+        }
+        // running best and second best (smallest keys)
+        for (dy = dys; dy < dye; dy++) {
+          for (dx = dxs; dx < dxe; dx++) {
+            real v = correlation ? -cost[dy*maxw+dx] : cost[dy*maxw+dx];
+            if (n == 0 || v < bv) {
+              sv = bv; bv = v; best = dy*maxw+dx;
+            } else if (n == 1 || v < sv) {
+              sv = v;
+            }
+            n++;
+          }
+        }
+        dy = best/maxw;
+        dx = best%maxw;
+        c0 = cost[best];
+        out[0] = dy+1;
+        out[os[2]] = dx+1;
+        sub[0] = (dy > dys && dy < dye-1) ?
+          nn_SpatialMatching_parabola(cost[best-maxw], c0, cost[best+maxw]) : 0;
+        sub[ss[2]] = (dx > dxs && dx < dxe-1) ?
+          nn_SpatialMatching_parabola(cost[best-1], c0, cost[best+1]) : 0;
+        b = correlation ? -bv : bv;
+        sb = correlation ? -sv : sv;
+        if (n < 2)
+          *rat = 1;
+        else if (correlation)
+          *rat = (b != 0) ? sb/b : 1;
+        else
+          *rat = (sb != 0) ? b/sb : 1;
       }
     }
+
+    THFree(cost);
   }
 
   // done
@@ -195,6 +1106,10 @@ static int nn_(SpatialMatching_updateGradInput)(lua_State *L)
 static const struct luaL_Reg nn_(SpatialMatching__) [] = {
   {"SpatialMatching_updateOutput", nn_(SpatialMatching_updateOutput)},
   {"SpatialMatching_updateGradInput", nn_(SpatialMatching_updateGradInput)},
+  {"SpatialMatching_updateOutputTopk", nn_(SpatialMatching_updateOutputTopk)},
+  {"SpatialMatching_updateGradInputTopk", nn_(SpatialMatching_updateGradInputTopk)},
+  {"SpatialMatching_pyramidOutput", nn_(SpatialMatching_pyramidOutput)},
+  {"SpatialMatching_updateOutputWTA", nn_(SpatialMatching_updateOutputWTA)},
   {NULL, NULL}
 };
 
@@ -205,4 +1120,15 @@ static void nn_(SpatialMatching_init)(lua_State *L)
   lua_pop(L,1);
 }
 
+#ifdef NN_VEC
+#undef NN_VEC
+#undef NN_VLEN
+#undef NN_VZERO
+#undef NN_VLOAD
+#undef NN_VSTORE
+#undef NN_VSUB
+#undef NN_VADD
+#undef NN_VMUL
+#endif
+
 #endif
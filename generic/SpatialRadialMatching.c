@@ -6,51 +6,140 @@
 #define max(x,y) (((x)>(y)) ? (x) : (y))
 #define min(x,y) (((x)>(y)) ? (y) : (x))
 
+#ifndef NN_SPATIALRADIALMATCHING_MASK
+#define NN_SPATIALRADIALMATCHING_MASK
+
+static int nn_SpatialRadialMatching_cmpIndex(const void *a, const void *b)
+{
+  long ia = *(const long *)a, ib = *(const long *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+// the optional mask at index idx, as the sorted list of the linear indices
+// (n*iheight + y)*iwidth + x of its active pixels. The mask is either a
+// ByteTensor of the size of a cost map ([N]xHxW, nonzero = active), or a
+// LongTensor of 1-based coordinates, Mx2 (y,x) or, in batch mode, Mx3 (n,y,x).
+// Returns NULL when there is no mask, i.e. when all the pixels are active.
+static long *nn_SpatialRadialMatching_activePixels(lua_State *L, int idx, int batch, long nbatch,
+                                                   long iheight, long iwidth, long *nactive)
+{
+  THByteTensor *mask = luaT_toudata(L, idx, "torch.ByteTensor");
+  THLongTensor *coords = luaT_toudata(L, idx, "torch.LongTensor");
+  long *active;
+  long b, y, x, i, n = 0;
+
+  if (mask) {
+    luaL_argcheck(L, mask->nDimension == 2+batch
+                  && (!batch || mask->size[0] == nbatch)
+                  && mask->size[batch] == iheight && mask->size[batch+1] == iwidth, idx,
+                  "mask must be HxW (NxHxW in batch mode)");
+    unsigned char *mask_p = THByteTensor_data(mask);
+    long mbs = batch ? mask->stride[0] : 0;
+    long *ms = mask->stride + batch;
+    for (b = 0; b < nbatch; b++)
+      for (y = 0; y < iheight; y++)
+        for (x = 0; x < iwidth; x++)
+          n += (mask_p[b*mbs + y*ms[0] + x*ms[1]] != 0);
+    active = (long *)THAlloc(sizeof(long)*(n+1));
+    n = 0;
+    for (b = 0; b < nbatch; b++)
+      for (y = 0; y < iheight; y++)
+        for (x = 0; x < iwidth; x++)
+          if (mask_p[b*mbs + y*ms[0] + x*ms[1]])
+            active[n++] = (b*iheight + y)*iwidth + x;
+  } else if (coords) {
+    luaL_argcheck(L, coords->nDimension == 2 && coords->size[1] == 2+batch, idx,
+                  "coordinates must be Mx2 (y,x), or Mx3 (n,y,x) in batch mode");
+    long *coords_p = THLongTensor_data(coords);
+    long *cs = coords->stride;
+    active = (long *)THAlloc(sizeof(long)*(coords->size[0]+1));
+    for (i = 0; i < coords->size[0]; i++) {
+      b = batch ? coords_p[i*cs[0]]-1 : 0;
+      y = coords_p[i*cs[0] + batch*cs[1]]-1;
+      x = coords_p[i*cs[0] + (batch+1)*cs[1]]-1;
+      if (b < 0 || b >= nbatch || y < 0 || y >= iheight || x < 0 || x >= iwidth) {
+        THFree(active);
+        luaL_error(L, "mask coordinates out of range");
+      }
+      active[i] = (b*iheight + y)*iwidth + x;
+    }
+    // sorted and without duplicates, as the backward accumulates
+    qsort(active, coords->size[0], sizeof(long), nn_SpatialRadialMatching_cmpIndex);
+    for (i = 0; i < coords->size[0]; i++)
+      if (n == 0 || active[i] != active[n-1])
+        active[n++] = active[i];
+  } else {
+    luaL_argcheck(L, lua_isnoneornil(L, idx), idx,
+                  "ByteTensor mask or LongTensor of coordinates expected");
+    *nactive = nbatch*iheight*iwidth;
+    return NULL;
+  }
+  *nactive = n;
+  return active;
+}
+
+#endif
+
 static int nn_(SpatialRadialMatching_updateOutput)(lua_State *L)
 {
   // get all params
   THTensor *input1  = luaT_checkudata(L, 2, torch_Tensor);
   THTensor *input2  = luaT_checkudata(L, 3, torch_Tensor);
-  //THLongTensor *mask= luaT_checkudata(L, 4, luaT_checktypename2id(L, "torch.LongTensor"));
   int maxh          = luaT_getfieldcheckint(L, 1, "maxh");
   THTensor *output  = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
 
-  // dims
-  int iwidth = input1->size[2];
-  int iheight = input1->size[1];
-  int ichannels = input1->size[0];
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+
+  // active pixels (all of them without a mask); the others output 0
+  long nactive;
+  long *active = nn_SpatialRadialMatching_activePixels(L, 4, batch, nbatch, iheight, iwidth, &nactive);
+  if (active)
+    THTensor_(zero)(output);
 
   // get strides
-  long *i1s = input1->stride;
-  long *i2s = input2->stride;
-  //long *ms  = mask  ->stride;
-  long *os  = output->stride;
+  long i1bs = batch ? input1->stride[0] : 0;
+  long i2bs = batch ? input2->stride[0] : 0;
+  long obs  = batch ? output->stride[0] : 0;
+  long *i1s = input1->stride + batch;
+  long *i2s = input2->stride + batch;
+  long *os  = output->stride + batch;
 
   // get pointers
   real *input1_p = THTensor_(data)(input1);
   real *input2_p = THTensor_(data)(input2);
-  //long *mask_p   = THLongTensor_data(mask);
   real *output_p = THTensor_(data)(output);
 
-  // compute output
+  // compute output, over the active pixels of all samples: every pixel
+  // costs the same, so a static partition of the list balances the threads
+  long i;
   int x1,y1,y2,k;
   real dist;
-#pragma omp parallel for private(y1,x1,y2,k,dist)
-  for (y1 = 0; y1 < iheight; y1++) {
-    for (x1 = 0; x1 < iwidth; x1++) {
-      //if (mask_p[y1*ms[0] + x1*ms[1]]) {
-	for (y2 = y1; y2 < y1+maxh; y2++) {
-	  dist = 0.0f;
-	  for (k = 0; k < ichannels; k++)
-	    dist += square(  input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]]
-			     - input2_p[k*i2s[0] + y2*i2s[1] + x1*i2s[2]]);
-	  output_p[(y2-y1)*os[2] + y1*os[0] + x1*os[1]] = dist;
-	}
-	//}
+#pragma omp parallel for private(i,y1,x1,y2,k,dist) schedule(static)
+  for (i = 0; i < nactive; i++) {
+    long p = active ? active[i] : i;
+    long b = p/((long)iheight*iwidth);
+    real *in1 = input1_p + b*i1bs;
+    real *in2 = input2_p + b*i2bs;
+    real *out = output_p + b*obs;
+    y1 = (p/iwidth)%iheight;
+    x1 = p%iwidth;
+    for (y2 = y1; y2 < y1+maxh; y2++) {
+      dist = 0.0f;
+      for (k = 0; k < ichannels; k++)
+        dist += square(  in1[k*i1s[0] + y1*i1s[1] + x1*i1s[2]]
+                         - in2[k*i2s[0] + y2*i2s[1] + x1*i2s[2]]);
+      out[(y2-y1)*os[2] + y1*os[0] + x1*os[1]] = dist;
     }
   }
   
   // done
+  THFree(active);
   return 0;
 }
 
@@ -60,23 +149,57 @@ static int nn_(SpatialRadialMatching_updateGradInput)(lua_State *L)
   THTensor*     input1 = luaT_checkudata(L, 2, torch_Tensor);
   THTensor*     input2 = luaT_checkudata(L, 3, torch_Tensor);
   THTensor* gradOutput = luaT_checkudata(L, 4, torch_Tensor);
-  //THLongTensor*   mask = luaT_checkudata(L, 5, luaT_checktypename2id(L, "torch.LongTensor"));
   THTensor* gradInput1 = luaT_getfieldcheckudata(L, 1, "gradInput1", torch_Tensor);
   THTensor* gradInput2 = luaT_getfieldcheckudata(L, 1, "gradInput2", torch_Tensor);
   int             maxh = luaT_getfieldcheckint(L, 1, "maxh");
 
-  // dims
-  int iwidth    = input1->size[2];
-  int iheight   = input1->size[1];
-  int ichannels = input1->size[0];
+  // dims (3D inputs are a batch of one sample)
+  int batch     = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                                 input2->nDimension, input2->size);
+  long nbatch   = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight   = input1->size[batch+1];
+  int iwidth    = input1->size[batch+2];
+
+  // active pixels, whose outputs are the only ones depending on the inputs
+  long nactive;
+  long *active = nn_SpatialRadialMatching_activePixels(L, 5, batch, nbatch, iheight, iwidth, &nactive);
+
+  // the search is along the column of each pixel (x2 = x1), so the columns
+  // of all samples are independent: bucket the active pixels by column
+  long ncols = nbatch*iwidth;
+  long *colfirst = NULL, *colrows = NULL;
+  long u, i;
+  if (active) {
+    colfirst = (long *)THAlloc(sizeof(long)*(ncols+1));
+    colrows = (long *)THAlloc(sizeof(long)*(nactive+1));
+    for (u = 0; u <= ncols; u++)
+      colfirst[u] = 0;
+    for (i = 0; i < nactive; i++)
+      colfirst[(active[i]/((long)iheight*iwidth))*iwidth + active[i]%iwidth + 1]++;
+    for (u = 0; u < ncols; u++)
+      colfirst[u+1] += colfirst[u];
+    // the list is sorted, so the rows of each column come out increasing
+    for (i = 0; i < nactive; i++) {
+      u = (active[i]/((long)iheight*iwidth))*iwidth + active[i]%iwidth;
+      colrows[colfirst[u]++] = (active[i]/iwidth)%iheight;
+    }
+    for (u = ncols; u > 0; u--)
+      colfirst[u] = colfirst[u-1];
+    colfirst[0] = 0;
+  }
 
   // get strides
-  long* i1s  = input1->stride;
-  long* i2s  = input2->stride;
-  long* gi1s = gradInput1->stride;
-  long* gi2s = gradInput2->stride;
-  long* gos  = gradOutput->stride;
-  //long* ms   = mask->stride;
+  long  i1bs = batch ? input1->stride[0] : 0;
+  long  i2bs = batch ? input2->stride[0] : 0;
+  long gi1bs = batch ? gradInput1->stride[0] : 0;
+  long gi2bs = batch ? gradInput2->stride[0] : 0;
+  long  gobs = batch ? gradOutput->stride[0] : 0;
+  long* i1s  = input1->stride + batch;
+  long* i2s  = input2->stride + batch;
+  long* gi1s = gradInput1->stride + batch;
+  long* gi2s = gradInput2->stride + batch;
+  long* gos  = gradOutput->stride + batch;
   
   // get pointers
   real* input1_p     = THTensor_(data)(input1);
@@ -84,34 +207,159 @@ static int nn_(SpatialRadialMatching_updateGradInput)(lua_State *L)
   real* gradInput1_p = THTensor_(data)(gradInput1);
   real* gradInput2_p = THTensor_(data)(gradInput2);
   real* gradOutput_p = THTensor_(data)(gradOutput);
-  //long* mask_p       = THLongTensor_data(mask);
   
-  // compute gradients
-  int x1, y1, y2, k;
-  real partial_d;
-  for (y1 = 0; y1 < iheight; y1++) {
-    for (x1 = 0; x1 < iwidth; x1++) {
-      // if (mask_p[y1*ms[0] + x1*ms[1]]) {
-	for (y2 = y1; y2 < y1+maxh; y2++) {
-	  for (k = 0; k < ichannels; k++) {
-	    partial_d = 2.0f*(  input1_p[k*i1s[0] + y1*i1s[1] + x1*i1s[2]]
-				- input2_p[k*i2s[0] + y2*i2s[1] + x1*i2s[2]]);
-	    partial_d *= gradOutput_p[(y2-y1)*gos[2]+y1*gos[0]+x1*gos[1]];
-	    gradInput1_p[k*gi1s[0] + y1*gi1s[1] + x1*gi1s[2]] += partial_d;
-	    gradInput2_p[k*gi2s[0] + y2*gi2s[1] + x1*gi2s[2]] -= partial_d;
-	  }
-	}
-	//}
+  // compute gradients, one column at a time: each thread owns the columns it
+  // processes in both gradInput1 and gradInput2, so there are no races
+#pragma omp parallel for private(u) schedule(guided)
+  for (u = 0; u < ncols; u++) {
+    long b = u/iwidth;
+    int x1 = u%iwidth;
+    real *in1 = input1_p + b*i1bs + x1*i1s[2];
+    real *in2 = input2_p + b*i2bs + x1*i2s[2];
+    real *gi1 = gradInput1_p + b*gi1bs + x1*gi1s[2];
+    real *gi2 = gradInput2_p + b*gi2bs + x1*gi2s[2];
+    real *go  = gradOutput_p + b*gobs + x1*gos[1];
+    long nrows = active ? colfirst[u+1]-colfirst[u] : iheight;
+    long j;
+    int y1, d, k;
+    for (j = 0; j < nrows; j++) {
+      y1 = active ? colrows[colfirst[u]+j] : j;
+      real *g   = go + y1*gos[0];
+      real *a   = in1 + y1*i1s[1];
+      real *ga  = gi1 + y1*gi1s[1];
+      real *bk  = in2 + y1*i2s[1];
+      real *gbk = gi2 + y1*gi2s[1];
+      for (k = 0; k < ichannels; k++) {
+        // d(out[d])/d(in1) = 2*(a-b[d]) = -d(out[d])/d(in2[d])
+        real ak = a[k*i1s[0]];
+        accreal acc = 0;
+        for (d = 0; d < maxh; d++) {
+          real partial_d = 2*(ak - bk[d*i2s[1]])*g[d*gos[2]];
+          acc += partial_d;
+          gbk[d*gi2s[1]] -= partial_d;
+        }
+        ga[k*gi1s[0]] += acc;
+        bk += i2s[0];
+        gbk += gi2s[0];
+      }
+    }
+  }
+
+  THFree(colfirst);
+  THFree(colrows);
+  THFree(active);
+  // done
+  return 0;
+}
+
+// winner-take-all, without the cost volume: output is the dy of the best
+// match of each pixel (1-based, as in the dense output), subpixel its
+// parabolic refinement, and ratio the best cost over the second best one
+static int nn_(SpatialRadialMatching_updateOutputWTA)(lua_State *L)
+{
+  // get all params
+  THTensor *input1   = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *input2   = luaT_checkudata(L, 3, torch_Tensor);
+  int maxh           = luaT_getfieldcheckint(L, 1, "maxh");
+  THTensor *output   = luaT_getfieldcheckudata(L, 1, "output", torch_Tensor);
+  THTensor *subpixel = luaT_getfieldcheckudata(L, 1, "subpixel", torch_Tensor);
+  THTensor *ratio    = luaT_getfieldcheckudata(L, 1, "ratio", torch_Tensor);
+
+  // dims (3D inputs are a batch of one sample)
+  int batch = nn_SpatialMatching_checkInputs(L, input1->nDimension, input1->size,
+                                             input2->nDimension, input2->size);
+  long nbatch = batch ? input1->size[0] : 1;
+  int ichannels = input1->size[batch];
+  int iheight = input1->size[batch+1];
+  int iwidth = input1->size[batch+2];
+
+  if (batch) {
+    THTensor_(resize3d)(output, nbatch, iheight, iwidth);
+    THTensor_(resize3d)(subpixel, nbatch, iheight, iwidth);
+    THTensor_(resize3d)(ratio, nbatch, iheight, iwidth);
+  } else {
+    THTensor_(resize2d)(output, iheight, iwidth);
+    THTensor_(resize2d)(subpixel, iheight, iwidth);
+    THTensor_(resize2d)(ratio, iheight, iwidth);
+  }
+
+  // active pixels; the others have no match (0), and a ratio of 1
+  long nactive;
+  long *active = nn_SpatialRadialMatching_activePixels(L, 4, batch, nbatch, iheight, iwidth, &nactive);
+  if (active) {
+    THTensor_(zero)(output);
+    THTensor_(zero)(subpixel);
+    THTensor_(fill)(ratio, 1);
+  }
+
+  // get strides
+  long i1bs = batch ? input1->stride[0] : 0;
+  long i2bs = batch ? input2->stride[0] : 0;
+  long obs  = batch ? output->stride[0] : 0;
+  long sbs  = batch ? subpixel->stride[0] : 0;
+  long rbs  = batch ? ratio->stride[0] : 0;
+  long *i1s = input1->stride + batch;
+  long *i2s = input2->stride + batch;
+  long *os  = output->stride + batch;
+  long *ss  = subpixel->stride + batch;
+  long *rs  = ratio->stride + batch;
+
+  // get pointers
+  real *input1_p   = THTensor_(data)(input1);
+  real *input2_p   = THTensor_(data)(input2);
+  real *output_p   = THTensor_(data)(output);
+  real *subpixel_p = THTensor_(data)(subpixel);
+  real *ratio_p    = THTensor_(data)(ratio);
+
+  long i;
+#pragma omp parallel private(i)
+  {
+    // costs of one pixel
+    real *cost = (real *)THAlloc(sizeof(real)*maxh);
+    int x1, y1, y2, k, best;
+    real dist, bv, sv;
+
+#pragma omp for schedule(static)
+    for (i = 0; i < nactive; i++) {
+      long p = active ? active[i] : i;
+      long b = p/((long)iheight*iwidth);
+      real *in1 = input1_p + b*i1bs;
+      real *in2 = input2_p + b*i2bs;
+      y1 = (p/iwidth)%iheight;
+      x1 = p%iwidth;
+      best = 0;
+      bv = sv = 0;
+      for (y2 = y1; y2 < y1+maxh; y2++) {
+        dist = 0.0f;
+        for (k = 0; k < ichannels; k++)
+          dist += square(  in1[k*i1s[0] + y1*i1s[1] + x1*i1s[2]]
+                         - in2[k*i2s[0] + y2*i2s[1] + x1*i2s[2]]);
+        cost[y2-y1] = dist;
+        // running best and second best
+        if (y2 == y1 || dist < bv) {
+          sv = bv; bv = dist; best = y2-y1;
+        } else if (y2 == y1+1 || dist < sv) {
+          sv = dist;
+        }
+      }
+      output_p[b*obs + y1*os[0] + x1*os[1]] = best+1;
+      subpixel_p[b*sbs + y1*ss[0] + x1*ss[1]] = (best > 0 && best < maxh-1) ?
+        nn_SpatialMatching_parabola(cost[best-1], cost[best], cost[best+1]) : 0;
+      ratio_p[b*rbs + y1*rs[0] + x1*rs[1]] = (maxh > 1 && sv != 0) ? bv/sv : 1;
     }
+
+    THFree(cost);
   }
 
   // done
+  THFree(active);
   return 0;
 }
 
 static const struct luaL_Reg nn_(SpatialRadialMatching__) [] = {
   {"SpatialRadialMatching_updateOutput", nn_(SpatialRadialMatching_updateOutput)},
   {"SpatialRadialMatching_updateGradInput", nn_(SpatialRadialMatching_updateGradInput)},
+  {"SpatialRadialMatching_updateOutputWTA", nn_(SpatialRadialMatching_updateOutputWTA)},
   {NULL, NULL}
 };
 
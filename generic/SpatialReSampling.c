@@ -9,6 +9,98 @@
 #define MIN(a,b) ( ((a)<(b)) ? (a) : (b) )
 #endif
 
+#ifndef NN_SPATIALRESAMPLING_TAPS
+#define NN_SPATIALRESAMPLING_TAPS
+// bilinear interpolation along one axis: output position o reads the input at
+// idx[2*o] and idx[2*o+1] (the latter clamped to the border), with weights
+// w[2*o] and w[2*o+1]
+static void nn_SpatialReSampling_bilinearTaps(long isize, long osize, long *idx, float *w)
+{
+  // mapping ratio
+  float ratio = (osize > 1) ? (float)(isize-1) / (osize-1) : 0;
+  long o;
+  for (o = 0; o < osize; o++) {
+    // subpixel position, and its 2 nearest neighbors:
+    float pos = ratio*o;
+    long i = floor(pos);
+    idx[2*o] = i;
+    idx[2*o+1] = MIN(i+1, isize-1);
+    w[2*o] = (float)(i+1) - pos;
+    w[2*o+1] = pos - (float)i;
+  }
+}
+
+// the transpose of a set of taps, where output position o reads the input
+// positions idx[j], with weights w[j], for j in [first[o], first[o+1]): input
+// position i is read by the output positions tidx[j], with weights tw[j], for
+// j in [tfirst[i], tfirst[i+1]) (in increasing output order)
+static void nn_SpatialReSampling_transposeTaps(long isize, long osize, long *first, long *idx, float *w,
+                                               long *tfirst, long *tidx, float *tw)
+{
+  long i, j, o;
+  for (i = 0; i <= isize; i++)
+    tfirst[i] = 0;
+  for (j = 0; j < first[osize]; j++)
+    tfirst[idx[j]+1]++;
+  for (i = 0; i < isize; i++)
+    tfirst[i+1] += tfirst[i];
+  for (o = 0; o < osize; o++) {
+    for (j = first[o]; j < first[o+1]; j++) {
+      tidx[tfirst[idx[j]]] = o;
+      tw[tfirst[idx[j]]++] = w[j];
+    }
+  }
+  for (i = isize; i > 0; i--)
+    tfirst[i] = tfirst[i-1];
+  tfirst[0] = 0;
+}
+
+// the transpose of the bilinear taps (tidx and tw have 2*osize entries)
+static void nn_SpatialReSampling_bilinearGatherTaps(long isize, long osize, long *tfirst, long *tidx, float *tw)
+{
+  long *first = (long *)THAlloc(sizeof(long)*(osize+1));
+  long *idx = (long *)THAlloc(sizeof(long)*2*osize);
+  float *w = (float *)THAlloc(sizeof(float)*2*osize);
+  long o;
+  for (o = 0; o <= osize; o++)
+    first[o] = 2*o;
+  nn_SpatialReSampling_bilinearTaps(isize, osize, idx, w);
+  nn_SpatialReSampling_transposeTaps(isize, osize, first, idx, w, tfirst, tidx, tw);
+  THFree(first);
+  THFree(idx);
+  THFree(w);
+}
+#endif
+
+// row y of a separable resampling of a plane, from taps in the format of
+// nn_SpatialReSampling_transposeTaps: the source rows read by row y are summed
+// in tmp (a swidth buffer), then each destination pixel sums the columns it
+// reads. ds and ss are the row and column strides of the planes. With the
+// transposed taps, this is the gradient of the resampling, for input row y.
+static void nn_(SpatialReSampling_separableRow)(real *dst_p, long *ds, real *src_p, long *ss,
+                                                int y, int dwidth, int swidth,
+                                                long *yfirst, long *yidx, float *yw,
+                                                long *xfirst, long *xidx, float *xw, real *tmp)
+{
+  real *dst = dst_p + y*ds[0];
+  long j;
+  int x;
+  for (x = 0; x < swidth; x++)
+    tmp[x] = 0;
+  for (j = yfirst[y]; j < yfirst[y+1]; j++) {
+    real *src = src_p + yidx[j]*ss[0];
+    real w = yw[j];
+    for (x = 0; x < swidth; x++)
+      tmp[x] += w * src[x*ss[1]];
+  }
+  for (x = 0; x < dwidth; x++) {
+    accreal sum = 0;
+    for (j = xfirst[x]; j < xfirst[x+1]; j++)
+      sum += xw[j] * tmp[xidx[j]];
+    dst[x*ds[1]] = sum;
+  }
+}
+
 static int nn_(SpatialReSampling_updateOutput)(lua_State *L)
 {
   // get all params
@@ -38,74 +130,54 @@ static int nn_(SpatialReSampling_updateOutput)(lua_State *L)
   else
     THTensor_(resize4d)(output_, batchSize, ochannels, oheight, owidth);
   
-  // select example
-  THTensor *output = THTensor_(newWithTensor)(output_);
-  THTensor *input = THTensor_(newWithTensor)(input_);
+  // get strides
+  long ibs = (input_->nDimension == 4) ? input_->stride[0] : 0;
+  long obs = (input_->nDimension == 4) ? output_->stride[0] : 0;
+  long *is = input_->stride + channelDim;
+  long *os = output_->stride + channelDim;
   
-  // select planes
-  THTensor *outputPlane = THTensor_(new)();
-  THTensor *inputPlane = THTensor_(new)();
-
-  // mapping ratios
-  float wratio = (float)(iwidth-1) / (owidth-1);
-  float hratio = (float)(iheight-1) / (oheight-1);
-
-  int b;
-  for (b=0; b<batchSize; b++) {
-    if (input_->nDimension == 4) 
-    {
-      THTensor_(select)(input, input_, 0, b);
-      THTensor_(select)(output, output_, 0, b);
-    }  
-    // resample each plane
-    int k;
-    for (k=0; k<ochannels; k++) {
-      // get planes
-      THTensor_(select)(inputPlane, input, 0, k);
-      THTensor_(select)(outputPlane, output, 0, k);
-
-      // for each plane, resample
-      int x,y;
-      for (y=0; y<oheight; y++) {
-        for (x=0; x<owidth; x++) {
-          // subpixel position:
-          float ix = wratio*x;
-          float iy = hratio*y;
-
-          // 4 nearest neighbors:
-          float ix_nw = floor(ix);
-          float iy_nw = floor(iy);
-          float ix_ne = ix_nw + 1;
-          float iy_ne = iy_nw;
-          float ix_sw = ix_nw;
-          float iy_sw = iy_nw + 1;
-          float ix_se = ix_nw + 1;
-          float iy_se = iy_nw + 1;
-
-          // get surfaces to each neighbor:
-          float se = (ix-ix_nw)*(iy-iy_nw);
-          float sw = (ix_ne-ix)*(iy-iy_ne);
-          float ne = (ix-ix_sw)*(iy_sw-iy);
-          float nw = (ix_se-ix)*(iy_se-iy);
-
-          // weighted sum of neighbors:
-          double sum = THTensor_(get2d)(inputPlane, iy_nw, ix_nw) * nw
-            + THTensor_(get2d)(inputPlane, iy_ne, MIN(ix_ne,iwidth-1)) * ne
-            + THTensor_(get2d)(inputPlane, MIN(iy_sw,iheight-1), ix_sw) * sw
-            + THTensor_(get2d)(inputPlane, MIN(iy_se,iheight-1), MIN(ix_se,iwidth-1)) * se;
-
-          // set output
-          THTensor_(set2d)(outputPlane, y, x, sum);
-        }
-      }
+  // get raw pointers
+  real *input_data = THTensor_(data)(input_);
+  real *output_data = THTensor_(data)(output_);
+
+  // the neighbors and weights of each column and each row, once for all planes
+  long *xidx = (long *)THAlloc(sizeof(long)*2*owidth);
+  long *yidx = (long *)THAlloc(sizeof(long)*2*oheight);
+  float *xw = (float *)THAlloc(sizeof(float)*2*owidth);
+  float *yw = (float *)THAlloc(sizeof(float)*2*oheight);
+  nn_SpatialReSampling_bilinearTaps(iwidth, owidth, xidx, xw);
+  nn_SpatialReSampling_bilinearTaps(iheight, oheight, yidx, yw);
+
+  // resample each row of each plane of each example
+  long r;
+#pragma omp parallel for private(r)
+  for (r = 0; r < (long)batchSize*ochannels*oheight; r++) {
+    long p = r/oheight;
+    int y = r%oheight;
+    real *input_p = input_data + (p/ochannels)*ibs + (p%ochannels)*is[0];
+    real *output_p = output_data + (p/ochannels)*obs + (p%ochannels)*os[0] + y*os[1];
+
+    // the 2 input rows, and their weights
+    real *row0 = input_p + yidx[2*y]*is[1];
+    real *row1 = input_p + yidx[2*y+1]*is[1];
+    float wy0 = yw[2*y];
+    float wy1 = yw[2*y+1];
+
+    int x;
+    for (x = 0; x < owidth; x++) {
+      long x0 = xidx[2*x]*is[2];
+      long x1 = xidx[2*x+1]*is[2];
+      // weighted sum of neighbors:
+      output_p[x*os[2]] = (row0[x0]*xw[2*x] + row0[x1]*xw[2*x+1]) * wy0
+                        + (row1[x0]*xw[2*x] + row1[x1]*xw[2*x+1]) * wy1;
     }
   }
 
   // cleanup
-  THTensor_(free)(inputPlane);
-  THTensor_(free)(outputPlane);
-  THTensor_(free)(input);
-  THTensor_(free)(output);
+  THFree(xidx);
+  THFree(yidx);
+  THFree(xw);
+  THFree(yw);
   return 1;
 }
 
@@ -136,80 +208,50 @@ static int nn_(SpatialReSampling_updateGradInput)(lua_State *L)
     THTensor_(resize3d)(gradInput_, ichannels, iheight, iwidth);
   else
     THTensor_(resize4d)(gradInput_, batchSize, ichannels, iheight, iwidth);
-  THTensor_(zero)(gradInput_);
   
-  // select example
-  THTensor *gradOutput = THTensor_(newWithTensor)(gradOutput_);
-  THTensor *gradInput = THTensor_(newWithTensor)(gradInput_);
-
-  // select planes
-  THTensor *gradOutputPlane = THTensor_(new)();
-  THTensor *gradInputPlane = THTensor_(new)();
-
-  // mapping ratios
-  float wratio = (float)(iwidth-1) / (owidth-1);
-  float hratio = (float)(iheight-1) / (oheight-1);
-
-  int b;
-  for (b=0; b<batchSize; b++) {
-    if (input_->nDimension == 4) 
-    {
-      THTensor_(select)(gradInput, gradInput_, 0, b);
-      THTensor_(select)(gradOutput, gradOutput_, 0, b);
+  // get strides
+  long gibs = (input_->nDimension == 4) ? gradInput_->stride[0] : 0;
+  long gobs = (input_->nDimension == 4) ? gradOutput_->stride[0] : 0;
+  long *gis = gradInput_->stride + channelDim;
+  long *gos = gradOutput_->stride + channelDim;
+
+  // get raw pointers
+  real *gradInput_data = THTensor_(data)(gradInput_);
+  real *gradOutput_data = THTensor_(data)(gradOutput_);
+
+  // the output columns and rows reading each input column and row
+  long *xfirst = (long *)THAlloc(sizeof(long)*(iwidth+1));
+  long *yfirst = (long *)THAlloc(sizeof(long)*(iheight+1));
+  long *xtidx = (long *)THAlloc(sizeof(long)*2*owidth);
+  long *ytidx = (long *)THAlloc(sizeof(long)*2*oheight);
+  float *xtw = (float *)THAlloc(sizeof(float)*2*owidth);
+  float *ytw = (float *)THAlloc(sizeof(float)*2*oheight);
+  nn_SpatialReSampling_bilinearGatherTaps(iwidth, owidth, xfirst, xtidx, xtw);
+  nn_SpatialReSampling_bilinearGatherTaps(iheight, oheight, yfirst, ytidx, ytw);
+
+  // each input row of each plane of each example gathers its gradient
+  long r;
+#pragma omp parallel private(r)
+  {
+    real *tmp = (real *)THAlloc(sizeof(real)*owidth);
+#pragma omp for
+    for (r = 0; r < (long)batchSize*ochannels*iheight; r++) {
+      long p = r/iheight;
+      real *gradInput_p = gradInput_data + (p/ochannels)*gibs + (p%ochannels)*gis[0];
+      real *gradOutput_p = gradOutput_data + (p/ochannels)*gobs + (p%ochannels)*gos[0];
+      nn_(SpatialReSampling_separableRow)(gradInput_p, gis+1, gradOutput_p, gos+1, r%iheight, iwidth, owidth,
+                                          yfirst, ytidx, ytw, xfirst, xtidx, xtw, tmp);
     }  
-    // compute gradients for each plane
-    int k;
-    for (k=0; k<ochannels; k++) {
-      // get planes
-      THTensor_(select)(gradInputPlane, gradInput, 0, k);
-      THTensor_(select)(gradOutputPlane, gradOutput, 0, k);
-
-      // for each plane, resample
-      int x,y;
-      for (y=0; y<oheight; y++) {
-        for (x=0; x<owidth; x++) {
-          // subpixel position:
-          float ix = wratio*x;
-          float iy = hratio*y;
-
-          // 4 nearest neighbors:
-          float ix_nw = floor(ix);
-          float iy_nw = floor(iy);
-          float ix_ne = ix_nw + 1;
-          float iy_ne = iy_nw;
-          float ix_sw = ix_nw;
-          float iy_sw = iy_nw + 1;
-          float ix_se = ix_nw + 1;
-          float iy_se = iy_nw + 1;
-
-          // get surfaces to each neighbor:
-          float se = (ix-ix_nw)*(iy-iy_nw);
-          float sw = (ix_ne-ix)*(iy-iy_ne);
-          float ne = (ix-ix_sw)*(iy_sw-iy);
-          float nw = (ix_se-ix)*(iy_se-iy);
-
-          // output gradient
-          double ograd = THTensor_(get2d)(gradOutputPlane, y, x);
-
-          // accumulate gradient
-          THTensor_(set2d)(gradInputPlane, iy_nw, ix_nw,
-                           THTensor_(get2d)(gradInputPlane, iy_nw, ix_nw) + nw * ograd);
-          THTensor_(set2d)(gradInputPlane, iy_ne, MIN(ix_ne,iwidth-1),
-                           THTensor_(get2d)(gradInputPlane, iy_ne, MIN(ix_ne,iwidth-1)) + ne * ograd);
-          THTensor_(set2d)(gradInputPlane, MIN(iy_sw,iheight-1), ix_sw, 
-                           THTensor_(get2d)(gradInputPlane, MIN(iy_sw,iheight-1), ix_sw) + sw * ograd);
-          THTensor_(set2d)(gradInputPlane, MIN(iy_se,iheight-1), MIN(ix_se,iwidth-1),
-                           THTensor_(get2d)(gradInputPlane, MIN(iy_se,iheight-1), MIN(ix_se,iwidth-1)) + se * ograd);
-        }
-      }
-    }
+    THFree(tmp);
   }
 
   // cleanup
-  THTensor_(free)(gradInputPlane);
-  THTensor_(free)(gradOutputPlane);
-  THTensor_(free)(gradInput);
-  THTensor_(free)(gradOutput);
+  THFree(xfirst);
+  THFree(yfirst);
+  THFree(xtidx);
+  THFree(ytidx);
+  THFree(xtw);
+  THFree(ytw);
   return 1;
 }
 
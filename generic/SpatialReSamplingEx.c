@@ -10,6 +10,114 @@
 #define MIN(a,b) ( ((a)<(b)) ? (a) : (b) )
 #endif
 
+#ifndef NN_SPATIALRESAMPLINGEX_FILTERS
+#define NN_SPATIALRESAMPLINGEX_FILTERS
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// the separable modes (mode_c), after simple (0), average (1) and bilinear (2)
+enum { NN_RESAMPLING_BICUBIC = 3, NN_RESAMPLING_LANCZOS = 4, NN_RESAMPLING_AREA = 5 };
+
+// the radius of the filter of a separable mode, in input pixels (when upsampling)
+static double nn_SpatialReSamplingEx_support(int mode)
+{
+  if (mode == NN_RESAMPLING_BICUBIC)
+    return 2;
+  if (mode == NN_RESAMPLING_LANCZOS)
+    return 3;
+  return 0.5;
+}
+
+// the filters: Keys cubic (a = -0.5) and Lanczos-3
+static double nn_SpatialReSamplingEx_filter(int mode, double x)
+{
+  x = fabs(x);
+  if (mode == NN_RESAMPLING_BICUBIC) {
+    const double a = -0.5;
+    if (x < 1)
+      return ((a+2)*x - (a+3))*x*x + 1;
+    if (x < 2)
+      return ((a*x - 5*a)*x + 8*a)*x - 4*a;
+    return 0;
+  }
+  if (x == 0)
+    return 1;
+  if (x < 3) {
+    double px = M_PI*x;
+    return 3*sin(px)*sin(px/3) / (px*px);
+  }
+  return 0;
+}
+
+// the taps of a separable mode along one axis, in the format of
+// nn_SpatialReSampling_transposeTaps (idx and w have osize*maxTaps entries).
+// Positions are pixel centers: output position o covers [o*scale, (o+1)*scale)
+// of the input, with scale = isize/osize. When downsampling, the filter is
+// stretched by scale, so that it antialiases (area averages the covered
+// pixels exactly). The weights are normalized, which also handles the borders.
+static long nn_SpatialReSamplingEx_maxTaps(int mode, long isize, long osize)
+{
+  double scale = (double)isize/osize;
+  return (long)ceil(2*nn_SpatialReSamplingEx_support(mode)*MAX(scale, 1)) + 2;
+}
+
+static void nn_SpatialReSamplingEx_filterTaps(int mode, long isize, long osize, long *first, long *idx, float *w)
+{
+  double scale = (double)isize/osize;
+  double fscale = MAX(scale, 1);
+  double radius = nn_SpatialReSamplingEx_support(mode)*fscale;
+  long o, i, j, n = 0;
+  first[0] = 0;
+  for (o = 0; o < osize; o++) {
+    double center = (o + 0.5)*scale;
+    long i0 = MAX((long)floor(center - radius), 0);
+    long i1 = MIN((long)ceil(center + radius), isize);
+    double sum = 0;
+    for (i = i0; i < i1; i++) {
+      double wi;
+      if (mode == NN_RESAMPLING_AREA) // overlap of [i, i+1) with the output pixel
+        wi = MIN(i+1, center + scale/2) - MAX(i, center - scale/2);
+      else
+        wi = nn_SpatialReSamplingEx_filter(mode, (i + 0.5 - center)/fscale);
+      if (wi == 0 || (mode == NN_RESAMPLING_AREA && wi < 0))
+        continue;
+      idx[n] = i;
+      w[n++] = wi;
+      sum += wi;
+    }
+    if (sum != 0)
+      for (j = first[o]; j < n; j++)
+        w[j] /= sum;
+    first[o+1] = n;
+  }
+}
+
+// the taps of a separable mode, transposed for the backward, in new arrays
+static void nn_SpatialReSamplingEx_newTaps(int mode, long isize, long osize, int transpose,
+                                           long **first, long **idx, float **w)
+{
+  long ntaps = osize*nn_SpatialReSamplingEx_maxTaps(mode, isize, osize);
+  long *tfirst = (long *)THAlloc(sizeof(long)*(osize+1));
+  long *tidx = (long *)THAlloc(sizeof(long)*ntaps);
+  float *tw = (float *)THAlloc(sizeof(float)*ntaps);
+  nn_SpatialReSamplingEx_filterTaps(mode, isize, osize, tfirst, tidx, tw);
+  if (transpose) {
+    *first = (long *)THAlloc(sizeof(long)*(isize+1));
+    *idx = (long *)THAlloc(sizeof(long)*(tfirst[osize]+1));
+    *w = (float *)THAlloc(sizeof(float)*(tfirst[osize]+1));
+    nn_SpatialReSampling_transposeTaps(isize, osize, tfirst, tidx, tw, *first, *idx, *w);
+    THFree(tfirst);
+    THFree(tidx);
+    THFree(tw);
+  } else {
+    *first = tfirst;
+    *idx = tidx;
+    *w = tw;
+  }
+}
+#endif
+
 static int nn_(SpatialReSamplingEx_updateOutput)(lua_State *L)
 {
   // get all params
@@ -82,6 +190,38 @@ static int nn_(SpatialReSamplingEx_updateOutput)(lua_State *L)
       }
     }
 
+  } else if (mode >= NN_RESAMPLING_BICUBIC) { // bicubic, lanczos or area
+
+    // the input rows and columns read by each output row and column
+    long *xfirst, *yfirst, *xidx, *yidx;
+    float *xw, *yw;
+    nn_SpatialReSamplingEx_newTaps(mode, iwidth, owidth, 0, &xfirst, &xidx, &xw);
+    nn_SpatialReSamplingEx_newTaps(mode, iheight, oheight, 0, &yfirst, &yidx, &yw);
+
+    // each output row of each plane: vertical pass into a row buffer, then
+    // horizontal pass
+    long r;
+#pragma omp parallel private(r)
+    {
+      real *tmp = (real *)THAlloc(sizeof(real)*iwidth);
+#pragma omp for
+      for (r = 0; r < (long)channels1*channels2*oheight; r++) {
+	long p = r/oheight;
+	real *input_p = input_data + (p/channels2)*is[0] + (p%channels2)*is[3];
+	real *output_p = output_data + (p/channels2)*os[0] + (p%channels2)*os[3];
+	nn_(SpatialReSampling_separableRow)(output_p, os+1, input_p, is+1, r%oheight, owidth, iwidth,
+					    yfirst, yidx, yw, xfirst, xidx, xw, tmp);
+      }
+      THFree(tmp);
+    }
+
+    THFree(xfirst);
+    THFree(yfirst);
+    THFree(xidx);
+    THFree(yidx);
+    THFree(xw);
+    THFree(yw);
+
   } else { // simple or average
     assert((mode == 0) || (mode == 1));
         
@@ -181,9 +321,6 @@ static int nn_(SpatialReSamplingEx_updateGradInput)(lua_State *L)
   int channels1 = gradOutput->size[0];
   int channels2 = gradOutput->size[3];
 
-  // zero gradInput
-  THTensor_(zero)(gradInput);
-
   // get strides
   long *gis = gradInput->stride;
   long *gos = gradOutput->stride;
@@ -194,58 +331,75 @@ static int nn_(SpatialReSamplingEx_updateGradInput)(lua_State *L)
   
   if (mode == 2) { //bilinear
     
-    // mapping ratios
-    float wratio = (float)(iwidth-1) / (owidth-1);
-    float hratio = (float)(iheight-1) / (oheight-1);
+    // the output columns and rows reading each input column and row
+    long *xfirst = (long *)THAlloc(sizeof(long)*(iwidth+1));
+    long *yfirst = (long *)THAlloc(sizeof(long)*(iheight+1));
+    long *xtidx = (long *)THAlloc(sizeof(long)*2*owidth);
+    long *ytidx = (long *)THAlloc(sizeof(long)*2*oheight);
+    float *xtw = (float *)THAlloc(sizeof(float)*2*owidth);
+    float *ytw = (float *)THAlloc(sizeof(float)*2*oheight);
+    nn_SpatialReSampling_bilinearGatherTaps(iwidth, owidth, xfirst, xtidx, xtw);
+    nn_SpatialReSampling_bilinearGatherTaps(iheight, oheight, yfirst, ytidx, ytw);
 
-    // compute gradients for each plane
-    int k1, k2, x, y;
-    for (k1 = 0; k1 < channels1; ++k1) {
-      for (k2 = 0; k2 < channels2; ++k2) {
-	
-	// get planes
-	real *gradInput_p = gradInput_data + k1*gis[0] + k2*gis[3];
-	real *gradOutput_p = gradOutput_data + k1*gos[0] + k2*gos[3];
-	
-	// for each plane, resample
-	for (y = 0; y < oheight; ++y) {
-	  for (x = 0; x < owidth; ++x) {
-	    
-	    // subpixel position:
-	    const float ix = wratio*x;
-	    const float iy = hratio*y;
+    // each input row of each plane gathers its gradient
+    long r;
+#pragma omp parallel private(r)
+    {
+      real *tmp = (real *)THAlloc(sizeof(real)*owidth);
+#pragma omp for
+      for (r = 0; r < (long)channels1*channels2*iheight; r++) {
+	long p = r/iheight;
+	real *gradInput_p = gradInput_data + (p/channels2)*gis[0] + (p%channels2)*gis[3];
+	real *gradOutput_p = gradOutput_data + (p/channels2)*gos[0] + (p%channels2)*gos[3];
+	nn_(SpatialReSampling_separableRow)(gradInput_p, gis+1, gradOutput_p, gos+1, r%iheight, iwidth, owidth,
+					    yfirst, ytidx, ytw, xfirst, xtidx, xtw, tmp);
+      }
+      THFree(tmp);
+    }
 
-	    // 4 nearest neighbors:
-	    const int ix_nw = floor(ix);
-	    const int iy_nw = floor(iy);
-	    const int ix_ne = ix_nw + 1;
-	    const int iy_ne = iy_nw;
-	    const int ix_sw = ix_nw;
-	    const int iy_sw = iy_nw + 1;
-	    const int ix_se = ix_nw + 1;
-	    const int iy_se = iy_nw + 1;
+    THFree(xfirst);
+    THFree(yfirst);
+    THFree(xtidx);
+    THFree(ytidx);
+    THFree(xtw);
+    THFree(ytw);
 
-	    // get surfaces to each neighbor:
-	    const float se = (ix-(float)ix_nw)*(iy-(float)iy_nw);
-	    const float sw = ((float)ix_ne-ix)*(iy-(float)iy_ne);
-	    const float ne = (ix-(float)ix_sw)*((float)iy_sw-iy);
-	    const float nw = ((float)ix_se-ix)*((float)iy_se-iy);
+  } else if (mode >= NN_RESAMPLING_BICUBIC) { // bicubic, lanczos or area
 
-	    // output gradient
-	    const double ograd = gradOutput_p[y*gos[1] + x*gos[2]];
+    // the output rows and columns reading each input row and column
+    long *xfirst, *yfirst, *xtidx, *ytidx;
+    float *xtw, *ytw;
+    nn_SpatialReSamplingEx_newTaps(mode, iwidth, owidth, 1, &xfirst, &xtidx, &xtw);
+    nn_SpatialReSamplingEx_newTaps(mode, iheight, oheight, 1, &yfirst, &ytidx, &ytw);
 
-	    // accumulate gradient
-	    gradInput_p[iy_nw*gis[1] + ix_nw*gis[2]] += nw * ograd;
-	    gradInput_p[iy_ne*gis[1] + MIN(ix_ne,iwidth-1)*gis[2]] += ne * ograd;
-	    gradInput_p[MIN(iy_sw,iheight-1)*gis[1] + ix_sw*gis[2]] += sw * ograd;
-	    gradInput_p[MIN(iy_se,iheight-1)*gis[1] + MIN(ix_se,iwidth-1)*gis[2]] += se*ograd;
-	  }
-	}
+    // each input row of each plane gathers its gradient
+    long r;
+#pragma omp parallel private(r)
+    {
+      real *tmp = (real *)THAlloc(sizeof(real)*owidth);
+#pragma omp for
+      for (r = 0; r < (long)channels1*channels2*iheight; r++) {
+	long p = r/iheight;
+	real *gradInput_p = gradInput_data + (p/channels2)*gis[0] + (p%channels2)*gis[3];
+	real *gradOutput_p = gradOutput_data + (p/channels2)*gos[0] + (p%channels2)*gos[3];
+	nn_(SpatialReSampling_separableRow)(gradInput_p, gis+1, gradOutput_p, gos+1, r%iheight, iwidth, owidth,
+					    yfirst, ytidx, ytw, xfirst, xtidx, xtw, tmp);
       }
+      THFree(tmp);
     }
+	
+    THFree(xfirst);
+    THFree(yfirst);
+    THFree(xtidx);
+    THFree(ytidx);
+    THFree(xtw);
+    THFree(ytw);
 
   } else { // simple or average
     assert((mode == 0) || (mode == 1));
+
+    // zero gradInput
+    THTensor_(zero)(gradInput);
   
     // compute gradients
     if (oheight >= iheight) { 
@@ -9,9 +9,6 @@
 #define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
 #define nn_(NAME) TH_CONCAT_3(nn_, Real, NAME)
 
-#include "generic/SpatialReSamplingEx.c"
-#include "THGenerateFloatTypes.h"
-
 #include "generic/SpatialLinear.c"
 #include "THGenerateFloatTypes.h"
 
@@ -24,6 +21,10 @@
 #include "generic/SpatialReSampling.c"
 #include "THGenerateFloatTypes.h"
 
+// (after SpatialReSampling.c, whose bilinear tables it uses)
+#include "generic/SpatialReSamplingEx.c"
+#include "THGenerateFloatTypes.h"
+
 #include "generic/SpatialMaxSampling.c"
 #include "THGenerateFloatTypes.h"
 
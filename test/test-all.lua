@@ -117,6 +117,30 @@ function nnxtest.SpatialReSamplingEx2() template_SpatialReSamplingEx(false, 'sim
 function nnxtest.SpatialReSamplingEx3() template_SpatialReSamplingEx(false, 'average' ) end
 function nnxtest.SpatialReSamplingEx4() template_SpatialReSamplingEx(true , 'bilinear') end
 function nnxtest.SpatialReSamplingEx5() template_SpatialReSamplingEx(false, 'bilinear') end
+function nnxtest.SpatialReSamplingEx6() template_SpatialReSamplingEx(true , 'bicubic' ) end
+function nnxtest.SpatialReSamplingEx7() template_SpatialReSamplingEx(false, 'bicubic' ) end
+function nnxtest.SpatialReSamplingEx8() template_SpatialReSamplingEx(false, 'lanczos' ) end
+function nnxtest.SpatialReSamplingEx9() template_SpatialReSamplingEx(false, 'area'    ) end
+
+function nnxtest.SpatialReSamplingEx_filters()
+   local input = torch.rand(3, 12, 16)
+   -- area downsampling by 2 averages 2x2 blocks
+   local area = nn.SpatialReSamplingEx{owidth=8, oheight=6, mode='area'}:forward(input)
+   local average = nn.SpatialReSamplingEx{owidth=8, oheight=6, mode='average'}:forward(input)
+   mytester:assertTensorEq(area, average, 1e-10, 'area downsampling')
+   for _,mode in ipairs{'bicubic', 'lanczos', 'area'} do
+      -- same size: identity
+      local same = nn.SpatialReSamplingEx{owidth=16, oheight=12, mode=mode}:forward(input)
+      mytester:assertTensorEq(same, input, 1e-6, mode .. ' identity')
+      -- normalized weights: constants are preserved, up or down
+      for _,size in ipairs{{5, 7}, {30, 21}, {9, 40}} do
+         local module = nn.SpatialReSamplingEx{oheight=size[1], owidth=size[2], mode=mode}
+         local output = module:forward(torch.Tensor(3, 12, 16):fill(0.5))
+         mytester:asserteq(output:size(2), size[1], mode .. ' output height')
+         mytester:assertlt((output - 0.5):abs():max(), 1e-6, mode .. ' constant')
+      end
+   end
+end
 
 function nnxtest.SpatialUpSampling()
    local fanin = math.random(1,4)
@@ -378,8 +402,8 @@ end
 function nnxtest.SpatialPyramid_focused() template_SpatialPyramid(5,3) end
 function nnxtest.SpatialPyramid_unfocused() template_SpatialPyramid() end
 
-local function template_SpatialGraph(channels, iwidth, iheight, dist, norm)
-   local module = nn.SpatialGraph{normalize=norm, dist=dist}
+local function template_SpatialGraph(channels, iwidth, iheight, dist, norm, connex)
+   local module = nn.SpatialGraph{normalize=norm, dist=dist, connex=connex}
    local input = torch.rand(iwidth, iheight, channels)
    local err = nn.Jacobian.testJacobian(module, input, 0.1, 1)
    mytester:assertlt(err, precision, 'error on state ')
@@ -393,8 +417,47 @@ function nnxtest.SpatialGraph_2() template_SpatialGraph(16, 4, 4, 'euclid', true
 function nnxtest.SpatialGraph_3() template_SpatialGraph(256, 2, 2, 'euclid', false) end
 function nnxtest.SpatialGraph_4() template_SpatialGraph(2, 16, 16, 'cosine', false) end
 function nnxtest.SpatialGraph_5() template_SpatialGraph(64, 3, 3, 'cosine', false) end
+function nnxtest.SpatialGraph_6() template_SpatialGraph(8, 6, 6, 'cosine', true) end
+function nnxtest.SpatialGraph_7() template_SpatialGraph(4, 8, 8, 'euclid', true, 8) end
+function nnxtest.SpatialGraph_8() template_SpatialGraph(4, 8, 8, 'cosine', false, 8) end
+
+function nnxtest.SpatialGraph_stencil()
+   local input = torch.rand(3, 7, 9)
+   for _,dist in ipairs{'euclid', 'cosine'} do
+      local connex4 = nn.SpatialGraph{dist=dist}:forward(input)
+      local connex8 = nn.SpatialGraph{dist=dist, connex=8}:forward(input)
+      mytester:asserteq(connex8:size(1), 4, 'connex 8 output size')
+      mytester:assertTensorEq(connex8:narrow(1, 1, 2), connex4, 1e-10, 'connex 8 right and down edges')
+      local module = nn.SpatialGraph{dist=dist, stencil={{2,-1}, {-1,1}}}
+      local output = module:forward(input)
+      mytester:assertTensorEq(output[2], connex8[4], 1e-10, 'stencil bottom-left edges')
+      -- edges to (y-1,x+2): 0 on the first row and on the last 2 columns
+      mytester:asserteq(output[1]:narrow(1, 1, 1):abs():max(), 0, 'stencil edges out of the map')
+      mytester:asserteq(output[1]:narrow(2, 8, 2):abs():max(), 0, 'stencil edges out of the map')
+      local a, b = input:select(2, 5):select(2, 3), input:select(2, 4):select(2, 5)
+      local expected = (dist == 'euclid') and (a-b):norm()/math.sqrt(3)
+         or 1 - (a+1e-12):dot(b+1e-12)/(a+1e-12):norm()/(b+1e-12):norm()
+      mytester:assertlt(math.abs(output[1][5][3] - expected), 1e-10, 'stencil edge value')
+   end
+end
 
-local function template_SpatialMatching(channels, iwidth, iheight, maxw, maxh, full_output)
+function nnxtest.SpatialGraph_batch()
+   local input = torch.rand(3, 4, 7, 9)
+   for _,dist in ipairs{'euclid', 'cosine'} do
+      local module = nn.SpatialGraph{normalize=true, dist=dist}
+      local output = module:forward(input):clone()
+      local gradOutput = torch.rand(output:size())
+      local gradInput = module:backward(input, gradOutput)
+      mytester:asserteq(output:dim(), 4, 'batch output dim')
+      for i = 1,input:size(1) do
+         local single = nn.SpatialGraph{normalize=true, dist=dist}
+         mytester:assertTensorEq(output[i], single:forward(input[i]), 1e-10, 'batch forward')
+         mytester:assertTensorEq(gradInput[i], single:backward(input[i], gradOutput[i]), 1e-10, 'batch gradInput')
+      end
+   end
+end
+
+local function template_SpatialMatching(channels, iwidth, iheight, maxw, maxh, full_output, mode, k)
    local module = nn.Sequential()
    module:add(nn.SplitTable(1))
    local parallel = nn.ParallelTable()
@@ -404,7 +467,7 @@ local function template_SpatialMatching(channels, iwidth, iheight, maxw, maxh, f
    parallel:add(seq1)
    parallel:add(nn.Identity())
    module:add(parallel)
-   module:add(nn.SpatialMatching(maxh, maxw, full_output))
+   module:add(nn.SpatialMatching(maxh, maxw, full_output, mode):keepBest(k))
    local input = torch.rand(2, channels, iheight, iwidth)
    local err = nn.Jacobian.testJacobian(module, input)
    mytester:assertlt(err, precision, 'error on state ')
@@ -419,6 +482,239 @@ function nnxtest.SpatialMatching_3() template_SpatialMatching(3, 16, 16, 6, 6, t
 function nnxtest.SpatialMatching_4() template_SpatialMatching(3, 20, 20, 4, 4, false) end
 function nnxtest.SpatialMatching_5() template_SpatialMatching(3, 12, 16, 5, 7, true) end
 --function nnxtest.SpatialMatching_6() template_SpatialMatching(4, 16, 32, 9, 5, false) end
+function nnxtest.SpatialMatching_7() template_SpatialMatching(11, 14, 10, 7, 3, true) end
+function nnxtest.SpatialMatching_8() template_SpatialMatching(11, 16, 10, 7, 3, false) end
+function nnxtest.SpatialMatching_gemm_1() template_SpatialMatching(4, 16, 16, 5, 5, true, 'gemm') end
+function nnxtest.SpatialMatching_gemm_2() template_SpatialMatching(3, 24, 10, 11, 3, false, 'gemm') end
+function nnxtest.SpatialMatching_correlation_1() template_SpatialMatching(4, 16, 16, 5, 5, true, 'correlation') end
+function nnxtest.SpatialMatching_correlation_2() template_SpatialMatching(3, 24, 10, 11, 3, false, 'correlation') end
+function nnxtest.SpatialMatching_topk_1() template_SpatialMatching(4, 16, 16, 5, 5, true, 'l2', 4) end
+function nnxtest.SpatialMatching_topk_2() template_SpatialMatching(3, 20, 12, 7, 3, false, 'l2', 3) end
+function nnxtest.SpatialMatching_topk_3() template_SpatialMatching(4, 16, 16, 5, 5, true, 'correlation', 4) end
+
+function nnxtest.SpatialMatching_pyramid()
+   -- smooth image, and a crop of it shifted by (4,6)
+   local image = nn.SpatialReSampling{owidth=48, oheight=40}:forward(torch.rand(3, 10, 12))
+   local sy, sx = 4, 6
+   local in1 = image:narrow(2, 1+sy, 40-8):narrow(3, 1+sx, 48-12)
+   local module = nn.SpatialMatching(9, 13, false):pyramid(2)
+   local values = module:forward{in1, image}
+   local offsets = module.offsets
+   mytester:asserteq(values:dim(), 3, 'pyramid output dim')
+   mytester:asserteq(values:size(3), 1, 'pyramid output size')
+   local found = offsets:select(4, 1):eq(sy+1):cmul(offsets:select(4, 2):eq(sx+1)):sum()
+   mytester:assertgt(found, 0.9*in1:size(2)*in1:size(3), 'pyramid displacement')
+
+   -- the values are the ones of the exhaustive search at the same offsets
+   local dense = nn.SpatialMatching(9, 13, false):forward{in1, image}
+   for y = 1,in1:size(2),5 do
+      for x = 1,in1:size(3),5 do
+         local dy, dx = offsets[y][x][1][1], offsets[y][x][1][2]
+         mytester:assertlt(math.abs(dense[y][x][dy][dx] - values[y][x][1]), 1e-10, 'pyramid values')
+      end
+   end
+
+   -- gradients through the matches found
+   local gradInput = module:backward({in1, image}, values:clone():fill(1))
+   mytester:asserteq(gradInput[1]:size(2), in1:size(2), 'pyramid gradInput')
+
+   -- back to the exhaustive search, and to the dense output
+   mytester:assertTensorEq(module:pyramid():forward{in1, image}, dense, 1e-10, 'pyramid off')
+   mytester:asserteq(module:keepBest(3):pyramid(2):pyramid().k, 3, 'pyramid keeps keepBest')
+end
+
+function nnxtest.SpatialMatching_winnerTakeAll()
+   for _,full_output in ipairs{true, false} do
+      local in1 = torch.rand(4, 8, 9)
+      local in2 = full_output and torch.rand(4, 8, 9) or torch.rand(4, 12, 15)
+      local dense = nn.SpatialMatching(5, 7, full_output):forward{in1, in2}
+      local module = nn.SpatialMatching(5, 7, full_output):winnerTakeAll()
+      local best = module:forward{in1, in2}
+      mytester:asserteq(best:dim(), 3, 'wta output dim')
+      for y = 1,8 do
+         for x = 1,9 do
+            local sorted = torch.sort(dense[y][x]:clone():resize(5*7))
+            local dy, dx = best[y][x][1], best[y][x][2]
+            mytester:asserteq(dense[y][x][dy][dx], sorted[1], 'wta best')
+            mytester:assertlt(math.abs(module.ratio[y][x] - sorted[1]/sorted[2]), 1e-10, 'wta ratio')
+            mytester:assertle(math.abs(module.subpixel[y][x][1]), 0.5, 'wta subpixel')
+         end
+      end
+   end
+   local radial = nn.SpatialRadialMatching(5)
+   local in1, in2 = torch.rand(4, 8, 9), torch.rand(4, 12, 9)
+   local dense = radial:forward{in1, in2}:clone()
+   local best = radial:winnerTakeAll():forward{in1, in2}
+   local min, argmin = dense:min(3)
+   mytester:assertTensorEq(best, argmin:select(3, 1):typeAs(best), 1e-10, 'radial wta best')
+end
+
+function nnxtest.SpatialMatching_batch()
+   local nbatch = 3
+   local in1 = torch.rand(nbatch, 4, 6, 7)
+   local in2 = torch.rand(nbatch, 4, 10, 13)
+   for _,config in ipairs{{false, 'l2'}, {true, 'l2'}, {false, 'gemm'}, {true, 'correlation'}} do
+      local full_output, mode = config[1], config[2]
+      local i2 = full_output and torch.rand(nbatch, 4, 6, 7) or in2
+      local module = nn.SpatialMatching(5, 7, full_output, mode)
+      local output = module:forward{in1, i2}:clone()
+      local gradOutput = torch.rand(output:size())
+      local gradInput = module:backward({in1, i2}, gradOutput)
+      local best = module:keepBest(3):forward{in1, i2}:clone()
+      local offsets = module.offsets:clone()
+      local wta = module:winnerTakeAll():forward{in1, i2}:clone()
+      for i = 1,nbatch do
+         local single = nn.SpatialMatching(5, 7, full_output, mode)
+         mytester:assertTensorEq(output[i], single:forward{in1[i], i2[i]}, 1e-10, 'batch forward')
+         local gi = single:backward({in1[i], i2[i]}, gradOutput[i])
+         mytester:assertTensorEq(gradInput[1][i], gi[1], 1e-10, 'batch gradInput1')
+         mytester:assertTensorEq(gradInput[2][i], gi[2], 1e-10, 'batch gradInput2')
+         mytester:assertTensorEq(best[i], single:keepBest(3):forward{in1[i], i2[i]}, 1e-10, 'batch keepBest')
+         mytester:assertTensorEq(offsets[i], single.offsets, 0, 'batch keepBest offsets')
+         mytester:assertTensorEq(wta[i], single:winnerTakeAll():forward{in1[i], i2[i]}, 0, 'batch winnerTakeAll')
+      end
+   end
+
+   local radial = nn.SpatialRadialMatching(4)
+   local output = radial:forward{in1, in2:narrow(4, 1, 7)}:clone()
+   local gradOutput = torch.rand(output:size())
+   local gradInput = radial:backward({in1, in2:narrow(4, 1, 7)}, gradOutput)
+   for i = 1,nbatch do
+      local single = nn.SpatialRadialMatching(4)
+      local input = {in1[i], in2[i]:narrow(3, 1, 7)}
+      mytester:assertTensorEq(output[i], single:forward(input), 1e-10, 'radial batch forward')
+      local gi = single:backward(input, gradOutput[i])
+      mytester:assertTensorEq(gradInput[1][i], gi[1], 1e-10, 'radial batch gradInput1')
+      mytester:assertTensorEq(gradInput[2][i], gi[2], 1e-10, 'radial batch gradInput2')
+   end
+end
+
+function nnxtest.SpatialRadialMatching_mask()
+   for _,nbatch in ipairs{0, 2} do
+      local size = nbatch > 0 and {nbatch} or {}
+      local function sized(...)
+         local s = {unpack(size)}
+         for _,d in ipairs{...} do table.insert(s, d) end
+         return torch.LongStorage(s)
+      end
+      local in1 = torch.rand(sized(4, 6, 7))
+      local in2 = torch.rand(sized(4, 6+3, 7))
+      local mask = torch.rand(sized(6, 7)):gt(0.6)
+      -- the same pixels as a list of coordinates, with a duplicate
+      local coords = {}
+      local flat = mask:clone():resize(mask:nElement())
+      for i = 1,flat:size(1) do
+         if flat[i] ~= 0 then
+            local p, c = i-1, {}
+            for d = mask:dim(),1,-1 do
+               table.insert(c, 1, p % mask:size(d) + 1)
+               p = math.floor(p / mask:size(d))
+            end
+            table.insert(coords, c)
+         end
+      end
+      table.insert(coords, coords[1])
+      coords = torch.LongTensor(coords)
+
+      local dense = nn.SpatialRadialMatching(4)
+      local output = dense:forward{in1, in2}:clone()
+      local gradOutput = torch.rand(output:size())
+      local expanded = mask:double():resize(sized(6, 7, 1)):expandAs(output)
+      local gradInput = dense:backward({in1, in2}, torch.cmul(gradOutput, expanded))
+      for _,active in ipairs{mask, coords} do
+         local module = nn.SpatialRadialMatching(4)
+         local masked = module:forward{in1, in2, active}
+         mytester:assertTensorEq(masked, torch.cmul(output, expanded), 1e-10, 'masked forward')
+         local gi = module:backward({in1, in2, active}, gradOutput)
+         mytester:assertTensorEq(gi[1], gradInput[1], 1e-10, 'masked gradInput1')
+         mytester:assertTensorEq(gi[2], gradInput[2], 1e-10, 'masked gradInput2')
+         local wta = module:winnerTakeAll():forward{in1, in2, active}
+         local all = dense:winnerTakeAll():forward{in1, in2}
+         dense:winnerTakeAll(false)
+         mytester:assertTensorEq(wta, torch.cmul(all, mask:double()), 0, 'masked winnerTakeAll')
+      end
+   end
+end
+
+function nnxtest.SpatialMatching_modes()
+   local input1 = torch.rand(5, 10, 22)
+   local input2 = torch.rand(5, 14, 30)
+   for _,full_output in ipairs{true, false} do
+      local in1 = full_output and input1 or input1:narrow(2, 3, 10-4):narrow(3, 5, 22-8)
+      local in2 = full_output and input1 or input2
+      local l2 = nn.SpatialMatching(5, 9, full_output):forward{in1, in2}
+      local gemm = nn.SpatialMatching(5, 9, full_output, 'gemm'):forward{in1, in2}
+      mytester:assertTensorEq(l2, gemm, 1e-10, 'gemm mode distances')
+      local corr = nn.SpatialMatching(5, 9, full_output, 'correlation'):forward{in1, in2}
+      -- ||a-b||^2 = ||a||^2 + ||b||^2 - 2*a.b
+      local y1, x1, dy, dx = 3, 4, 2, 6
+      local y2, x2 = y1 + dy - 1, x1 + dx - 1
+      if full_output then
+         y2, x2 = y2 - 2, x2 - 4
+      end
+      local a = in1:select(2, y1):select(2, x1)
+      local b = in2:select(2, y2):select(2, x2)
+      mytester:assertlt(math.abs(corr[y1][x1][dy][dx] - a:dot(b)), 1e-10, 'correlation')
+      mytester:assertlt(math.abs(l2[y1][x1][dy][dx] - (a-b):pow(2):sum()), 1e-10, 'distance')
+   end
+end
+
+function nnxtest.SpatialMatching_repack()
+   -- backward on inputs with as many elements as the forward's, but other sizes
+   local module = nn.SpatialMatching(5, 5, true)
+   module:forward{torch.rand(4, 6, 8), torch.rand(4, 6, 8)}
+   local in1, in2 = torch.rand(4, 8, 6), torch.rand(4, 8, 6)
+   local gradOutput = torch.rand(8, 6, 5, 5)
+   local gradInput = module:backward({in1, in2}, gradOutput)
+   local single = nn.SpatialMatching(5, 5, true)
+   single:forward{in1, in2}
+   local gi = single:backward({in1, in2}, gradOutput)
+   mytester:assertTensorEq(gradInput[1], gi[1], 1e-10, 'repacked gradInput1')
+   mytester:assertTensorEq(gradInput[2], gi[2], 1e-10, 'repacked gradInput2')
+end
+
+function nnxtest.SpatialMatching_keepBest()
+   local k = 6
+   for _,mode in ipairs{'l2', 'correlation'} do
+      for _,full_output in ipairs{true, false} do
+         local in1 = torch.rand(4, 8, 9)
+         local in2 = full_output and torch.rand(4, 8, 9) or torch.rand(4, 12, 15)
+         local dense = nn.SpatialMatching(5, 7, full_output, mode):forward{in1, in2}
+         local module = nn.SpatialMatching(5, 7, full_output, mode):keepBest(k)
+         local values = module:forward{in1, in2}
+         local offsets = module.offsets
+         mytester:asserteq(values:dim(), 3, 'topk output dim')
+         mytester:asserteq(values:size(3), k, 'topk output size')
+         for y = 1,8 do
+            for x = 1,9 do
+               local sorted = torch.sort(dense[y][x]:clone():resize(5*7), 1, mode == 'correlation')
+               mytester:assertTensorEq(values[y][x], sorted:narrow(1, 1, k), 1e-10, 'topk values')
+               for i = 1,k do
+                  local dy, dx = offsets[y][x][i][1], offsets[y][x][i][2]
+                  mytester:assertlt(math.abs(dense[y][x][dy][dx] - values[y][x][i]), 1e-10, 'topk offsets')
+               end
+            end
+         end
+      end
+   end
+end
+
+-- the tree of nnxtest.SoftMaxTree (root 29, leaves 9 to 28 and 30), a
+-- SoftMaxTree of inputSize 100 on it, and a batch of random inputs with
+-- leaf targets in [9, maxTarget] (default 28)
+local function softMaxTreeFixture(batchSize, maxTarget)
+   local hierarchy={
+      [29]=torch.IntTensor{30,1,2}, [1]=torch.IntTensor{3,4,5},
+      [2]=torch.IntTensor{6,7,8}, [3]=torch.IntTensor{9,10,11},
+      [4]=torch.IntTensor{12,13,14}, [5]=torch.IntTensor{15,16,17},
+      [6]=torch.IntTensor{18,19,20}, [7]=torch.IntTensor{21,22,23},
+      [8]=torch.IntTensor{24,25,26,27,28}
+   }
+   local smt = nn.SoftMaxTree(100, hierarchy, 29)
+   local input = torch.randn(batchSize, 100)
+   local target = torch.IntTensor(batchSize):random(9, maxTarget or 28)
+   return smt, input, target, hierarchy
+end
 
 function nnxtest.SoftMaxTree()
    local input = torch.randn(5,100)
@@ -509,6 +805,249 @@ function nnxtest.SoftMaxTree()
    mytester:assertTensorEq(bias3, bias, 0.000001)
 end
 
+function nnxtest.SoftMaxTree_grouped()
+   local smt, input, target = softMaxTreeFixture(20)
+   target[1] = 30
+   local grad = torch.randn(20)
+   local root_id = smt.rootId
+   local smt2 = smt:clone():groupNodes()
+   smt:zeroGradParameters()
+   smt2:zeroGradParameters()
+   local output = smt:forward{input, target}
+   local output2 = smt2:forward{input, target}
+   mytester:assertTensorEq(output, output2, 0.00001)
+   -- the path buffer holds exactly the paths of the batch
+   local bufferSize = 0
+   for i=1,target:size(1) do
+      local nodeId = target[i]
+      while nodeId ~= root_id do
+         local parentId = smt.childParent[nodeId][1]
+         bufferSize = bufferSize + smt.parentChildren[parentId][2]
+         nodeId = parentId
+      end
+   end
+   mytester:asserteq(smt._multiBuffer:size(1), bufferSize, 'SoftMaxTree path buffer size')
+   mytester:asserteq(smt2._multiBuffer:size(1), bufferSize, 'SoftMaxTree grouped path buffer size')
+   local gradInput = smt:backward({input, target}, grad)[1]
+   local gradInput2 = smt2:backward({input, target}, grad)[1]
+   mytester:assertTensorEq(gradInput, gradInput2, 0.00001)
+   mytester:assertTensorEq(smt.gradWeight, smt2.gradWeight, 0.00001)
+   mytester:assertTensorEq(smt.gradBias, smt2.gradBias, 0.00001)
+end
+
+function nnxtest.SoftMaxTree_wideRoot()
+   -- a root of 64 children is split into chunks by accGradParameters
+   local input = torch.randn(30,20)
+   local target = torch.IntTensor(30):random(1,68)
+   local hierarchy = {
+      [100]=torch.range(1,64):int(), [1]=torch.IntTensor{65,66}, [2]=torch.IntTensor{67,68}
+   }
+   local smt = nn.SoftMaxTree(20, hierarchy, 100)
+   smt:zeroGradParameters()
+   smt:forward{input, target}
+   smt:backward({input, target}, torch.ones(30))
+   local batchGradWeight, batchGradBias = smt.gradWeight:clone(), smt.gradBias:clone()
+   -- the sum of the gradients of the rows, one at a time
+   local gradWeight = smt.gradWeight:clone():zero()
+   local gradBias = smt.gradBias:clone():zero()
+   for i=1,input:size(1) do
+      smt:zeroGradParameters()
+      local row = {input:narrow(1,i,1), target:narrow(1,i,1)}
+      smt:forward(row)
+      smt:backward(row, torch.ones(1))
+      gradWeight:add(smt.gradWeight)
+      gradBias:add(smt.gradBias)
+   end
+   mytester:assertTensorEq(gradWeight, batchGradWeight, 0.000001, 'SoftMaxTree wide root gradWeight')
+   mytester:assertTensorEq(gradBias, batchGradBias, 0.000001, 'SoftMaxTree wide root gradBias')
+end
+
+function nnxtest.SoftMaxTree_sparseUpdate()
+   local smt, input, target = softMaxTreeFixture(10, 17)
+   local grad = torch.randn(10)
+   local lr, maxNorm = 0.1, 0.1
+   smt:zeroGradParameters()
+   local smt2 = smt:clone()
+   smt:forward{input, target}
+   smt:backward({input, target}, grad)
+   smt2:forward{input, target}
+   smt2:backward({input, target}, grad)
+   -- reference : dense ops on the touched parents (velocities start at 0)
+   local nUpdate = 0
+   for parentId in pairs(smt2.updates) do
+      local params, gradParams = smt2:getNodeParameters(parentId)
+      params[1]:add(-lr, gradParams[1])
+      params[2]:add(-lr, gradParams[2])
+      params[1]:renorm(2,1,maxNorm)
+      nUpdate = nUpdate + 1
+   end
+   mytester:assert(nUpdate > 0 and nUpdate < smt2.parentIds:size(1), 'SoftMaxTree sparse updates')
+   smt:sparseUpdate(lr, 0.9, maxNorm)
+   mytester:assertTensorEq(smt.weight, smt2.weight, 0.00001)
+   mytester:assertTensorEq(smt.bias, smt2.bias, 0.00001)
+   mytester:assertTensorEq(smt.momGradParams[1], smt2.gradWeight, 0.00001)
+   mytester:assertTensorEq(smt.momGradParams[2], smt2.gradBias, 0.00001)
+   mytester:asserteq(smt.gradWeight:abs():max(), 0, 'SoftMaxTree sparseUpdate gradWeight zeroed')
+   mytester:asserteq(smt.gradBias:abs():max(), 0, 'SoftMaxTree sparseUpdate gradBias zeroed')
+   mytester:asserteq(next(smt.updates), nil, 'SoftMaxTree sparseUpdate updates cleared')
+end
+
+function nnxtest.SoftMaxTree_quantize()
+   local smt, input, target = softMaxTreeFixture(20)
+   local output = smt:forward{input, target}:clone()
+   for mode, precision in pairs{int8=0.02, half=0.001} do
+      smt:quantize(mode)
+      local report = smt:quantizationReport{input, target}
+      mytester:assertlt(report.maxDelta, precision, 'SoftMaxTree quantize '..mode..' err')
+      mytester:assertlt(report.qweightBytes, report.weightBytes, 'SoftMaxTree quantize '..mode..' bytes')
+      mytester:assertTensorEq(smt:forward{input, target}, output, precision)
+   end
+   smt:quantize(false)
+   mytester:assertTensorEq(smt:forward{input, target}, output, 0.000001)
+   -- inference-only once the float weight is dropped
+   smt:quantize('half', true)
+   mytester:assert(smt.weightDropped and not smt.accUpdate, 'SoftMaxTree quantize dropWeight')
+   mytester:assertTensorEq(smt:forward{input, target}, output, 0.001)
+   mytester:assert(not pcall(smt.quantize, smt, false), 'SoftMaxTree quantize(false) after dropWeight')
+   mytester:assert(not pcall(smt.parameters, smt), 'SoftMaxTree parameters after dropWeight')
+   mytester:assert(not pcall(smt.updateParameters, smt, 0.1), 'SoftMaxTree updateParameters after dropWeight')
+   mytester:assert(not pcall(smt.accGradParameters, smt, {input, target}, torch.randn(20)), 
+      'SoftMaxTree accGradParameters after dropWeight')
+end
+
+function nnxtest.SoftMaxTree_buildHierarchy()
+   local nClass, inputSize = 100, 10
+   local frequencies = torch.range(1,nClass):pow(-1) -- zipf
+   local embeddings = torch.randn(nClass, 5)
+   local input = torch.randn(nClass, inputSize)
+   local target = torch.range(1,nClass):int()
+   for i,options in ipairs{
+         {maxFanout=4, inputSize=inputSize}, 
+         {maxFanout=4, mode='balanced', inputSize=inputSize}, 
+         {maxFanout=8, mode='balanced', embeddings=embeddings, inputSize=inputSize}
+      } do
+      local hierarchy, rootId, report = nn.SoftMaxTree.buildHierarchy(frequencies, options)
+      for parentId, children in pairs(hierarchy) do
+         mytester:assert(children:size(1) <= options.maxFanout, 'SoftMaxTree buildHierarchy fanout')
+      end
+      local smt = nn.SoftMaxTree(inputSize, hierarchy, rootId)
+      mytester:asserteq(smt.maxDept, report.maxDept, 'SoftMaxTree buildHierarchy maxDept')
+      mytester:assertlt(report.expectedFlops, report.flatFlops, 'SoftMaxTree buildHierarchy flops')
+      -- every class is a leaf of the tree
+      local output = smt:forward{input, target}
+      mytester:assert(output:max() < 0 and output:min() > -math.huge, 'SoftMaxTree buildHierarchy leaves')
+      local full = smt:fullOutput(input):narrow(2,1,nClass)
+      mytester:assertlt(math.abs(torch.exp(full):sum(2):mean() - 1), 0.00001, 'SoftMaxTree buildHierarchy sum')
+   end
+end
+
+function nnxtest.SoftMaxTree_binary()
+   local smt, input, target = softMaxTreeFixture(20)
+   target[1] = 30
+   local root_id = smt.rootId
+   local output = smt:forward{input, target}:clone()
+   -- same tree from a flat {childId, parentId} tensor
+   local edges = torch.IntTensor(smt.nChildNode, 2)
+   edges:select(2,1):copy(smt.childIds)
+   edges:select(2,2):copy(smt.childParent:select(2,1):index(1, smt.childIds:long()))
+   local smt2 = nn.SoftMaxTree(100, edges, root_id)
+   smt2.weight:copy(smt.weight)
+   smt2.bias:copy(smt.bias)
+   mytester:assertTensorEq(smt2.pathTable, smt.pathTable, 0.0000001)
+   mytester:assertTensorEq(smt2:forward{input, target}, output, 0.000001)
+   -- modules serialized without a path table rebuild it lazily
+   local pathTable, childIds = smt2.pathTable, smt2.childIds:clone()
+   smt2.pathTable, smt2.childPath = nil, nil
+   mytester:assertTensorEq(smt2:forward{input, target}, output, 0.000001)
+   mytester:assertTensorEq(smt2.pathTable, pathTable, 0)
+   mytester:assertTensorEq(smt2.childIds, childIds, 0)
+   -- memory-mapped binary files
+   local prefix = os.tmpname()
+   smt:saveBinary(prefix)
+   local smt3 = nn.SoftMaxTree.loadBinary(prefix)
+   mytester:asserteq(smt3.maxFamilyPath, smt.maxFamilyPath, 'SoftMaxTree loadBinary maxFamilyPath')
+   mytester:asserteq(smt3.maxDept, smt.maxDept, 'SoftMaxTree loadBinary maxDept')
+   mytester:assertTensorEq(smt3:forward{input, target}, output, 0.000001)
+   smt3:backward({input, target}, torch.randn(20))
+   -- invalid headers are refused
+   local tree = torch.IntStorage(prefix..'.tree'):clone()
+   local function refused(field, value, message)
+      local header = tree:clone()
+      header[field] = value
+      local file = torch.DiskFile(prefix..'.tree', 'w'):binary()
+      file:writeInt(header)
+      file:close()
+      local ok, err = pcall(nn.SoftMaxTree.loadBinary, prefix)
+      mytester:assert(not ok and err:find(message) ~= nil, 'SoftMaxTree loadBinary '..message)
+   end
+   refused(1, 0x54544d53, 'byte order')
+   refused(3, 0, 'inputSize')
+   refused(5, 0, 'number of edges')
+   refused(6, 2, 'elementSize')
+   os.remove(prefix)
+   os.remove(prefix..'.tree')
+   os.remove(prefix..'.weight')
+end
+
+function nnxtest.SoftMaxForest()
+   local _, input, target, hierarchy = softMaxTreeFixture(20)
+   local smf = nn.SoftMaxForest(100, {hierarchy, hierarchy, hierarchy}, {29, 29, 29})
+   local grad = torch.randn(20)
+   -- parallel experts vs the reference container
+   local output = smf:forward{input, target}:clone()
+   local output2 = smf.module:forward{input, target}
+   mytester:assertTensorEq(output, output2, 0.00001)
+   smf:zeroGradParameters()
+   local gradInput = smf:backward({input, target}, grad)[1]:clone()
+   local gradWeight = smf.smts[2].gradWeight:clone()
+   smf:zeroGradParameters()
+   smf.module:forward{input, target}
+   local gradInput2 = smf.module:backward({input, target}, grad)[1]
+   mytester:assertTensorEq(gradInput, gradInput2, 0.00001)
+   mytester:assertTensorEq(gradWeight, smf.smts[2].gradWeight, 0.00001)
+   -- experts with a small gate are skipped at inference
+   smf:skipThreshold(0.34):evaluate()
+   local output3 = smf:forward{input, target}
+   local gate = smf.gater.output
+   local best = gate:max(2):clamp(-math.huge, 0.34)
+   local kept = torch.cmul(gate, gate:ge(best:expandAs(gate)):double())
+   kept:cdiv(kept:sum(2):expandAs(kept))
+   local expected = torch.zeros(20)
+   for i=1,3 do
+      local smtOutput = smf.smts[i]:forward{input, target}
+      expected:add(torch.cmul(kept:select(2,i), smtOutput))
+   end
+   mytester:assertTensorEq(output3, expected, 0.00001)
+   -- without skipping, the kept weights are the gater's
+   smf:skipThreshold(0)
+   mytester:assertTensorEq(smf:forward{input, target}, output, 0.00001)
+end
+
+function nnxtest.SoftMaxTree_topk()
+   local smt, input = softMaxTreeFixture(5)
+   -- full distribution is consistent with the forward
+   local full = smt:fullOutput(input):clone()
+   for i,leafId in ipairs{30,9,15,20,28} do
+      local target = torch.IntTensor(5):fill(leafId)
+      local output = smt:forward{input, target}
+      mytester:assertTensorEq(full:select(2,leafId), output, 0.00001)
+   end
+   -- leaves sum to one
+   local leaves = torch.LongTensor{30,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28}
+   local leafProb = full:index(2, leaves):exp():sum(2)
+   mytester:assertTensorEq(leafProb, torch.ones(5,1):typeAs(leafProb), 0.00001)
+   -- top-k are the k best leaves
+   local k = 4
+   local logProb, leafIds = smt:topk(input, k)
+   local sorted, indices = full:index(2, leaves):sort(2, true)
+   mytester:assertTensorEq(logProb, sorted:narrow(2,1,k), 0.00001)
+   for i=1,5 do
+      for j=1,k do
+         mytester:asserteq(leafIds[i][j], leaves[indices[i][j]], 'topk leaf id')
+      end
+   end
+end
+
 function nnxtest.TreeNLLCriterion()
    local input = torch.randn(5,10)
    local target = torch.ones(5) --all targets are 1